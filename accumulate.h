@@ -0,0 +1,119 @@
+// Centroid accumulation: adds every point of [begin, end) to the sum and the
+// count of its cluster. Like the distance kernels, the loop is instantiated
+// for the common dimensionalities so the inner loop is fully unrolled.
+
+#ifndef ACCUMULATE_H
+#define ACCUMULATE_H
+
+#include <cstddef>
+
+#include "distance.h"
+
+typedef void (*AccumulateKernel)(const double *values, const int *labels, int begin, int end,
+                                 int total_values, double *sums, int *counts);
+
+template <int D>
+inline void accumulatePoints(const double *values, const int *labels, int begin, int end,
+                             int total_values, double *sums, int *counts)
+{
+    const int dims = D > 0 ? D : total_values;
+
+    for (int i = begin; i < end; i++)
+    {
+        int id_cluster = labels[i];
+        const double *row = values + (std::size_t)i * dims;
+        double *sum = sums + (std::size_t)id_cluster * dims;
+
+        for (int j = 0; j < dims; j++)
+            sum[j] += row[j];
+        counts[id_cluster]++;
+    }
+}
+
+template <int D>
+struct AccumulateFamily
+{
+    static constexpr AccumulateKernel kernel = accumulatePoints<D>;
+};
+
+inline AccumulateKernel selectAccumulateKernel(int total_values)
+{
+    return selectForDimension<AccumulateFamily>(total_values);
+}
+
+// --precision float: the rows are read as float. The sums are either kept
+// in double (mixed precision) or in float with Kahan compensation, where
+// compensation[k] holds the low order part lost by the last addition.
+
+typedef void (*AccumulateFloatKernel)(const float *values, const int *labels, int begin, int end,
+                                      int total_values, double *sums, int *counts);
+
+typedef void (*AccumulateKahanKernel)(const float *values, const int *labels, int begin, int end,
+                                      int total_values, float *sums, float *compensation, int *counts);
+
+template <int D>
+inline void accumulateFloatPoints(const float *values, const int *labels, int begin, int end,
+                                  int total_values, double *sums, int *counts)
+{
+    const int dims = D > 0 ? D : total_values;
+
+    for (int i = begin; i < end; i++)
+    {
+        int id_cluster = labels[i];
+        const float *row = values + (std::size_t)i * dims;
+        double *sum = sums + (std::size_t)id_cluster * dims;
+
+        for (int j = 0; j < dims; j++)
+            sum[j] += row[j];
+        counts[id_cluster]++;
+    }
+}
+
+template <int D>
+inline void accumulateKahanPoints(const float *values, const int *labels, int begin, int end,
+                                  int total_values, float *sums, float *compensation, int *counts)
+{
+    const int dims = D > 0 ? D : total_values;
+
+    for (int i = begin; i < end; i++)
+    {
+        int id_cluster = labels[i];
+        const float *row = values + (std::size_t)i * dims;
+        float *sum = sums + (std::size_t)id_cluster * dims;
+        float *lost = compensation + (std::size_t)id_cluster * dims;
+
+        for (int j = 0; j < dims; j++)
+        {
+            float y = row[j] - lost[j];
+            float t = sum[j] + y;
+
+            lost[j] = (t - sum[j]) - y;
+            sum[j] = t;
+        }
+        counts[id_cluster]++;
+    }
+}
+
+template <int D>
+struct AccumulateFloatFamily
+{
+    static constexpr AccumulateFloatKernel kernel = accumulateFloatPoints<D>;
+};
+
+template <int D>
+struct AccumulateKahanFamily
+{
+    static constexpr AccumulateKahanKernel kernel = accumulateKahanPoints<D>;
+};
+
+inline AccumulateFloatKernel selectAccumulateFloatKernel(int total_values)
+{
+    return selectForDimension<AccumulateFloatFamily>(total_values);
+}
+
+inline AccumulateKahanKernel selectAccumulateKahanKernel(int total_values)
+{
+    return selectForDimension<AccumulateKahanFamily>(total_values);
+}
+
+#endif
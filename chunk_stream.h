@@ -0,0 +1,330 @@
+// Out-of-core reading of a binary dataset (--out-of-core, OpenMP version):
+// every Lloyd pass streams the coordinates from the file in chunks of
+// chunk_points rows instead of loading them, so the memory used is two
+// chunks plus the K * total_values centroids (and the per-thread sums),
+// whatever the number of points.
+//
+// A reader thread does all the file I/O and fills the two chunk buffers in
+// turn (double buffering): while the threads of the assignment work on one
+// chunk the next one is being read. The reader does not stop at the end of
+// a pass, so the first chunk of the next iteration is read during the
+// centroid update.
+//
+// The labels of the previous pass, needed to count the points that changed
+// cluster, live in a scratch file (4 bytes per point, removed when the
+// stream is closed): they are read together with their chunk and written
+// back by the reader when the consumer releases the chunk, before its
+// buffer is refilled. A chunk is read again C chunks later, so with C >= 2
+// the write always comes first; the chunks are sized so that C >= 2
+// whenever there are two points. A dataset of a single chunk (one point)
+// has no scratch file: its labels stay in memory from pass to pass.
+
+#ifndef CHUNK_STREAM_H
+#define CHUNK_STREAM_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dataset_file.h"
+#include "point_matrix.h"
+
+// rows [first, first + count) of the pass; labels can be changed until the
+// next call to ChunkStream::next
+struct StreamChunk
+{
+    const double *rows;
+    int *labels;
+    long long first;
+    int count;
+};
+
+inline bool seekFile(FILE *file, long long offset)
+{
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+// size of an open file in bytes, or -1
+inline long long fileSize(FILE *file)
+{
+#ifdef _WIN32
+    return _fseeki64(file, 0, SEEK_END) == 0 ? _ftelli64(file) : -1;
+#else
+    return fseeko(file, 0, SEEK_END) == 0 ? (long long)ftello(file) : -1;
+#endif
+}
+
+class ChunkStream
+{
+private:
+    struct Slot
+    {
+        AlignedVector rows;
+        std::vector<int> labels;
+        long long chunk = 0; // index of the chunk in the pass
+        int count = 0;
+        bool full = false;  // filled by the reader, not yet released
+        bool dirty = false; // released with labels to write back
+    };
+
+    std::string path;
+    FILE *data, *scratch;
+    DatasetHeader header;
+    int total_points, total_values, chunk_points;
+    long long total_chunks;
+    Slot slots[2];
+    std::vector<float> staging; // float32 files: rows before widening
+    std::vector<int> resident_labels; // labels of the only chunk when total_chunks < 2
+
+    std::thread reader;
+    std::mutex mutex;
+    std::condition_variable slot_changed;
+    bool stopping;
+    long long sequence;      // chunks handed out since start(), over all passes
+    bool holding;            // the consumer still has slots[(sequence - 1) % 2]
+    double wait_seconds;     // time the consumer waited for the reader
+
+    void readRows(long long first, int count, double *rows)
+    {
+        std::size_t total = (std::size_t)count * total_values;
+        std::size_t value_size = header.value_type == DATASET_FLOAT32 ? sizeof(float) : sizeof(double);
+        bool ok = seekFile(data, header.values_offset + first * total_values * value_size);
+
+        if (header.value_type == DATASET_FLOAT64)
+            ok = ok && fread(rows, sizeof(double), total, data) == total;
+        else
+        {
+            staging.resize(total);
+            ok = ok && fread(staging.data(), sizeof(float), total, data) == total;
+
+            for (std::size_t v = 0; ok && v < total; v++)
+                rows[v] = staging[v];
+        }
+
+        if (!ok)
+            datasetError(path, "read error while streaming the coordinates");
+    }
+
+    void transferLabels(Slot &slot, bool write)
+    {
+        long long offset = slot.chunk * chunk_points * (long long)sizeof(int);
+        bool ok = seekFile(scratch, offset);
+
+        if (write)
+            ok = ok && fwrite(slot.labels.data(), sizeof(int), slot.count, scratch) == (std::size_t)slot.count;
+        else
+            ok = ok && fread(slot.labels.data(), sizeof(int), slot.count, scratch) == (std::size_t)slot.count;
+
+        if (!ok)
+            datasetError(path, "I/O error on the scratch label file");
+    }
+
+    void readerLoop()
+    {
+        for (long long filled = 0;; filled++)
+        {
+            Slot &slot = slots[filled % 2];
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                slot_changed.wait(lock, [&] { return stopping || !slot.full; });
+
+                if (stopping)
+                    return;
+            }
+
+            if (slot.dirty && scratch)
+                transferLabels(slot, true);
+
+            long long pass = filled / total_chunks;
+            slot.chunk = filled % total_chunks;
+            slot.count = std::min<long long>(chunk_points, total_points - slot.chunk * chunk_points);
+            slot.dirty = false;
+
+            readRows(slot.chunk * chunk_points, slot.count, slot.rows.data());
+
+            // nothing is assigned before the first pass (resident_labels
+            // start at -1 in the constructor)
+            if (scratch && pass == 0)
+                std::fill(slot.labels.begin(), slot.labels.begin() + slot.count, -1);
+            else if (scratch)
+                transferLabels(slot, false);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                slot.full = true;
+            }
+            slot_changed.notify_all();
+        }
+    }
+
+public:
+    // opens a binary dataset (see dataset_file.h); exits with a message when
+    // it is not one
+    ChunkStream(const std::string &path, int chunk_points)
+    {
+        this->path = path;
+        stopping = false;
+        sequence = 0;
+        holding = false;
+        wait_seconds = 0.0;
+
+        data = fopen(path.c_str(), "rb");
+
+        if (!data || fread(&header, sizeof(header), 1, data) != 1 || memcmp(header.magic, DATASET_MAGIC, 8) != 0 ||
+            header.version != DATASET_VERSION)
+            datasetError(path, "--out-of-core needs a binary dataset (see convertDataset)");
+
+        long long size = fileSize(data);
+        if (size < 0)
+            datasetError(path, "cannot read the dataset size");
+        checkDatasetHeader(path, header, (uint64_t)size);
+
+        total_points = header.total_points;
+        total_values = header.total_values;
+
+        // at least two chunks when there are two points (see above), and at
+        // least one point per chunk
+        this->chunk_points = std::max(1, std::min(chunk_points, (total_points + 1) / 2));
+        total_chunks = total_points > 0 ? (total_points + this->chunk_points - 1) / this->chunk_points : 1;
+
+        scratch = nullptr;
+        if (total_chunks < 2)
+            resident_labels.assign(this->chunk_points, -1);
+        else if (!(scratch = tmpfile()))
+            datasetError(path, "cannot create the scratch label file");
+
+        for (Slot &slot : slots)
+        {
+            slot.rows.resize((std::size_t)this->chunk_points * total_values);
+            if (scratch)
+                slot.labels.resize(this->chunk_points);
+        }
+    }
+
+    ~ChunkStream()
+    {
+        stop();
+        fclose(data);
+        if (scratch)
+            fclose(scratch);
+    }
+
+    ChunkStream(const ChunkStream &) = delete;
+    ChunkStream &operator=(const ChunkStream &) = delete;
+
+    int getTotalPoints() const
+    {
+        return total_points;
+    }
+
+    int getTotalValues() const
+    {
+        return total_values;
+    }
+
+    int getK() const
+    {
+        return header.K;
+    }
+
+    int getMaxIterations() const
+    {
+        return header.max_iterations;
+    }
+
+    int getChunkPoints() const
+    {
+        return chunk_points;
+    }
+
+    long long getTotalChunks() const
+    {
+        return total_chunks;
+    }
+
+    // bytes of the two chunk buffers (and of the float32 staging rows)
+    std::size_t getBufferBytes() const
+    {
+        std::size_t chunk_bytes = (std::size_t)chunk_points * (total_values * sizeof(double) + sizeof(int));
+        std::size_t staging_bytes = header.value_type == DATASET_FLOAT32 ? (std::size_t)chunk_points * total_values * sizeof(float) : 0;
+
+        return 2 * chunk_bytes + staging_bytes;
+    }
+
+    double getWaitSeconds() const
+    {
+        return wait_seconds;
+    }
+
+    // one row read directly from the file (the initial centers), only
+    // before start()
+    void readRow(int index, double *row)
+    {
+        readRows(index, 1, row);
+    }
+
+    // starts the reader thread; from then on the chunks come from next()
+    void start()
+    {
+        reader = std::thread(&ChunkStream::readerLoop, this);
+    }
+
+    // releases the previous chunk and waits for the next one; the chunks go
+    // round the file, total_chunks per pass
+    StreamChunk next()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        if (holding)
+        {
+            Slot &previous = slots[(sequence - 1) % 2];
+
+            previous.full = false;
+            previous.dirty = true;
+            slot_changed.notify_all();
+        }
+
+        Slot &slot = slots[sequence % 2];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        slot_changed.wait(lock, [&] { return slot.full; });
+        wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        sequence++;
+        holding = true;
+
+        StreamChunk chunk;
+        chunk.rows = slot.rows.data();
+        chunk.labels = scratch ? slot.labels.data() : resident_labels.data();
+        chunk.first = slot.chunk * chunk_points;
+        chunk.count = slot.count;
+        return chunk;
+    }
+
+    // stops the reader (it may be reading ahead into the next pass)
+    void stop()
+    {
+        if (!reader.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        slot_changed.notify_all();
+        reader.join();
+    }
+};
+
+#endif
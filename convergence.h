@@ -0,0 +1,164 @@
+// Stopping criteria of the Lloyd iterations, shared by the serial, OpenMP
+// and MPI versions.
+//
+// The loop always stops when no point changed cluster or at max_iterations.
+// Three optional criteria end it earlier, each one off when its tolerance
+// is 0:
+//
+//   --tol-shift S     no center moved more than S (euclidean distance)
+//   --tol-inertia R   the inertia (sum of the squared distances of the
+//                     points to their centers) dropped by less than R times
+//                     the inertia of the previous iteration
+//   --tol-changed F   at most F * total_points points changed cluster
+//
+// The values checked are global ones (in the MPI version the changed count
+// and the inertia travel in the fused reduction), so every version, thread
+// and rank takes the same decision; check() is const, so every thread of
+// the OpenMP region evaluates it on the same reduced values. The shift costs
+// K * total_values operations per iteration; the inertia comes from the
+// distances the assignment already computes, or one extra distance per
+// point for the Hamerly, GEMM and float paths.
+
+#ifndef CONVERGENCE_H
+#define CONVERGENCE_H
+
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+#include "options.h"
+
+enum ConvergenceReason
+{
+    CONVERGENCE_NONE = 0, // keep iterating
+    CONVERGENCE_NO_CHANGE,
+    CONVERGENCE_SHIFT,
+    CONVERGENCE_INERTIA,
+    CONVERGENCE_CHANGED
+};
+
+inline const char *convergenceReasonName(ConvergenceReason reason)
+{
+    switch (reason)
+    {
+    case CONVERGENCE_NO_CHANGE:
+        return "no point changed cluster";
+    case CONVERGENCE_SHIFT:
+        return "center shift below --tol-shift";
+    case CONVERGENCE_INERTIA:
+        return "inertia improvement below --tol-inertia";
+    case CONVERGENCE_CHANGED:
+        return "changed points below --tol-changed";
+    default:
+        return "not converged";
+    }
+}
+
+class ConvergenceCheck
+{
+private:
+    double tol_shift, tol_inertia, tol_changed;
+    long long total_points;
+    int K, total_values;
+    bool track_shift, track_inertia;
+    double previous_inertia; // used by converged()
+    std::vector<double> previous_centers; // K * total_values, only with track_shift
+    ConvergenceReason reason;
+
+public:
+    // measure_all also tracks the shift and the inertia without a tolerance
+    // (for the trace of instrumentation.h)
+    ConvergenceCheck(const Options &options = Options(), long long total_points = 0, int K = 0,
+                     int total_values = 0, bool measure_all = false)
+    {
+        tol_shift = options.tol_shift;
+        tol_inertia = options.tol_inertia;
+        tol_changed = options.tol_changed;
+        this->total_points = total_points;
+        this->K = K;
+        this->total_values = total_values;
+
+        track_shift = tol_shift > 0.0 || measure_all;
+        track_inertia = tol_inertia > 0.0 || measure_all;
+        previous_inertia = std::numeric_limits<double>::infinity();
+        reason = CONVERGENCE_NONE;
+
+        if (track_shift)
+            previous_centers.assign((std::size_t)K * total_values, 0.0);
+    }
+
+    // true when one of the optional criteria is on
+    bool hasTolerance() const
+    {
+        return tol_shift > 0.0 || tol_inertia > 0.0 || tol_changed > 0.0;
+    }
+
+    bool needsShift() const
+    {
+        return track_shift;
+    }
+
+    bool needsInertia() const
+    {
+        return track_inertia;
+    }
+
+    // remembers the initial position of a center
+    void setCenter(int id_cluster, const double *values)
+    {
+        for (int j = 0; j < total_values; j++)
+            previous_centers[(std::size_t)id_cluster * total_values + j] = values[j];
+    }
+
+    // distance the center moved since the previous call, which it replaces;
+    // calls for different centers can run in parallel
+    double centerShift(int id_cluster, const double *values)
+    {
+        double *previous = &previous_centers[(std::size_t)id_cluster * total_values];
+        double sum = 0.0;
+
+        for (int j = 0; j < total_values; j++)
+        {
+            double diff = values[j] - previous[j];
+            sum += diff * diff;
+            previous[j] = values[j];
+        }
+
+        return std::sqrt(sum);
+    }
+
+    // the criterion met by the global values of an iteration;
+    // previous_inertia is the one of the iteration before (infinity on the
+    // first iteration)
+    ConvergenceReason check(long long changed, double inertia, double previous_inertia, double max_shift) const
+    {
+        if (changed == 0)
+            return CONVERGENCE_NO_CHANGE;
+        if (tol_shift > 0.0 && max_shift <= tol_shift)
+            return CONVERGENCE_SHIFT;
+        if (tol_inertia > 0.0 && std::isfinite(previous_inertia) &&
+            previous_inertia - inertia <= tol_inertia * previous_inertia)
+            return CONVERGENCE_INERTIA;
+        if (tol_changed > 0.0 && changed <= tol_changed * total_points)
+            return CONVERGENCE_CHANGED;
+
+        return CONVERGENCE_NONE;
+    }
+
+    // check() for a single caller per iteration, which keeps the previous
+    // inertia here; true when the loop can stop
+    bool converged(long long changed, double inertia, double max_shift)
+    {
+        reason = check(changed, inertia, previous_inertia, max_shift);
+        previous_inertia = inertia;
+        return reason != CONVERGENCE_NONE;
+    }
+
+    const char *getReason() const
+    {
+        return convergenceReasonName(reason);
+    }
+};
+
+#endif
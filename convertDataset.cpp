@@ -0,0 +1,48 @@
+// Converts a dataset in the text format (the one written by
+// generateDataset.py) into the binary format read by the --input option
+// (see dataset_file.h).
+//
+// Usage: convertDataset [--float32] output.bin < large_dataset.txt
+
+#include <iostream>
+#include <string>
+
+#include "dataset_file.h"
+
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+    DatasetValueType value_type = DATASET_FLOAT64;
+    string output;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+
+        if (arg == "--float32")
+            value_type = DATASET_FLOAT32;
+        else
+            output = arg;
+    }
+
+    if (output.empty())
+    {
+        cerr << "Usage: " << argv[0] << " [--float32] output.bin < dataset.txt\n";
+        return 1;
+    }
+
+    int K, max_iterations;
+    PointMatrix points = readTextDataset(stdin, K, max_iterations);
+
+    if (!writeBinaryDataset(output, points, K, max_iterations, value_type))
+    {
+        cerr << output << ": write failed\n";
+        return 1;
+    }
+
+    cout << "Wrote " << points.getTotalPoints() << " points with " << points.getTotalValues() << " values to "
+         << output << "\n";
+
+    return 0;
+}
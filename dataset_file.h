@@ -0,0 +1,384 @@
+// Binary dataset format, read through a memory mapping.
+//
+// Layout of the file (all integers little endian, as written by the host):
+//
+//   [0, 64)              DatasetHeader
+//   [values_offset, ...) total_points * total_values coordinates, row-major,
+//                        float64 or float32 (value_type)
+//   [names_offset, ...)  only when has_name: total_points uint32 name
+//                        indexes, then uint32 total_names and, for every
+//                        distinct name, uint32 length + bytes
+//
+// A float64 file is clustered straight from the mapped pages: the mapping is
+// private (copy-on-write), so the PointMatrix view never copies the
+// coordinates and nothing is ever written back to the file. A float32 file
+// is half the size on disk but is widened to double while loading, except
+// for --precision float, where it is used from the mapping as well.
+//
+// The text files produced by generateDataset.py are converted with
+// convertDataset.cpp; text files are read by the parallel parser of
+// text_parser.h.
+
+#ifndef DATASET_FILE_H
+#define DATASET_FILE_H
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "point_matrix.h"
+#include "text_parser.h"
+
+enum DatasetValueType
+{
+    DATASET_FLOAT64 = 0,
+    DATASET_FLOAT32 = 1
+};
+
+struct DatasetHeader
+{
+    char magic[8]; // "KMEANSDS"
+    uint32_t version;
+    uint32_t value_type; // DatasetValueType
+    uint64_t total_points;
+    uint32_t total_values, K, max_iterations, has_name;
+    uint64_t values_offset;
+    uint64_t names_offset; // 0 without names
+    uint64_t reserved;
+};
+
+static_assert(sizeof(DatasetHeader) == 64, "DatasetHeader must keep its on-disk size");
+
+static const char DATASET_MAGIC[8] = {'K', 'M', 'E', 'A', 'N', 'S', 'D', 'S'};
+static const uint32_t DATASET_VERSION = 1;
+
+// read-only file mapping; the pages are private, so writes through the
+// pointer stay in this process
+class MappedFile
+{
+private:
+    char *address;
+    std::size_t length;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+
+public:
+    MappedFile(const std::string &path)
+    {
+        address = nullptr;
+        length = 0;
+
+#ifdef _WIN32
+        mapping = NULL;
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+            return;
+        length = (std::size_t)size.QuadPart;
+
+        mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        if (mapping == NULL)
+            return;
+
+        address = static_cast<char *>(MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0));
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+        {
+            length = st.st_size;
+            void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+            if (mapped != MAP_FAILED)
+            {
+                address = static_cast<char *>(mapped);
+                // the rows are streamed front to back by every iteration
+                madvise(address, length, MADV_SEQUENTIAL);
+            }
+        }
+
+        // the mapping stays valid after the descriptor is closed
+        close(fd);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (address)
+            UnmapViewOfFile(address);
+        if (mapping != NULL)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (address)
+            munmap(address, length);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const
+    {
+        return address != nullptr;
+    }
+
+    char *data() const
+    {
+        return address;
+    }
+
+    std::size_t size() const
+    {
+        return length;
+    }
+};
+
+inline bool isBinaryDataset(const std::string &path)
+{
+    char magic[8];
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+        return false;
+
+    bool binary = fread(magic, 1, 8, file) == 8 && memcmp(magic, DATASET_MAGIC, 8) == 0;
+    fclose(file);
+    return binary;
+}
+
+inline void datasetError(const std::string &path, const char *message)
+{
+    std::cerr << path << ": " << message << "\n";
+    exit(1);
+}
+
+// checks the header of a binary dataset (after its magic): the counts must
+// fit the int indexes of the programs and the blocks must lie inside the
+// file, so a corrupt or foreign file is rejected before any size or pointer
+// is derived from it
+inline void checkDatasetHeader(const std::string &path, const DatasetHeader &header, uint64_t file_size)
+{
+    if (header.value_type != DATASET_FLOAT64 && header.value_type != DATASET_FLOAT32)
+        datasetError(path, "unknown coordinate type");
+    if (header.total_points > INT_MAX || header.total_values == 0 || header.total_values > INT_MAX)
+        datasetError(path, "invalid number of points or values");
+    if (header.K > INT_MAX || header.max_iterations > INT_MAX)
+        datasetError(path, "invalid K or max_iterations");
+
+    uint64_t value_size = header.value_type == DATASET_FLOAT32 ? sizeof(float) : sizeof(double);
+
+    // divisions instead of products, which could wrap around
+    if (header.values_offset < sizeof(DatasetHeader) || header.values_offset > file_size ||
+        (file_size - header.values_offset) / value_size / header.total_values < header.total_points)
+        datasetError(path, "truncated coordinate block");
+
+    // the name index of every point and the number of names
+    if (header.has_name && (header.names_offset < sizeof(DatasetHeader) || header.names_offset > file_size ||
+                            (file_size - header.names_offset) / sizeof(uint32_t) < header.total_points + 1))
+        datasetError(path, "truncated name table");
+}
+
+// maps a binary dataset and returns a view over its coordinates (a copy only
+// for float32 files); the run parameters stored in the header are returned
+// through K and max_iterations. With single_precision (--precision float)
+// the points are float: a view for float32 files, a narrowed copy for
+// float64 ones.
+inline PointMatrix loadBinaryDataset(const std::string &path, int &K, int &max_iterations,
+                                     bool single_precision = false)
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(path);
+
+    if (!file->isOpen())
+        datasetError(path, "cannot map the dataset file");
+    if (file->size() < sizeof(DatasetHeader))
+        datasetError(path, "truncated dataset header");
+
+    DatasetHeader header;
+    memcpy(&header, file->data(), sizeof(header));
+
+    if (memcmp(header.magic, DATASET_MAGIC, 8) != 0 || header.version != DATASET_VERSION)
+        datasetError(path, "not a binary dataset (see convertDataset)");
+
+    checkDatasetHeader(path, header, file->size());
+
+    int total_points = header.total_points, total_values = header.total_values;
+    bool has_name = header.has_name != 0;
+    std::size_t total = (std::size_t)total_points * total_values;
+
+    K = header.K;
+    max_iterations = header.max_iterations;
+
+    char *block = file->data() + header.values_offset;
+    PointMatrix points;
+
+    if (single_precision && header.value_type == DATASET_FLOAT32)
+        points = PointMatrix(reinterpret_cast<float *>(block), file, total_points, total_values, has_name);
+    else if (single_precision)
+    {
+        points = PointMatrix(total_points, total_values, has_name, true);
+        const double *source = reinterpret_cast<const double *>(block);
+        float *target = points.floatData();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long long v = 0; v < (long long)total; v++)
+            target[v] = source[v];
+    }
+    else if (header.value_type == DATASET_FLOAT64)
+        points = PointMatrix(reinterpret_cast<double *>(block), file, total_points, total_values, has_name);
+    else
+    {
+        points = PointMatrix(total_points, total_values, has_name);
+        const float *source = reinterpret_cast<const float *>(block);
+        double *target = points.data();
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long long v = 0; v < (long long)total; v++)
+            target[v] = source[v];
+    }
+
+    if (has_name)
+    {
+        const char *names = file->data() + header.names_offset;
+        const char *end = file->data() + file->size();
+        const uint32_t *name_ids = reinterpret_cast<const uint32_t *>(names);
+        const char *table = names + (std::size_t)total_points * sizeof(uint32_t);
+
+        uint32_t total_names;
+        memcpy(&total_names, table, sizeof(total_names));
+        table += sizeof(total_names);
+
+        for (uint32_t n = 0; n < total_names; n++)
+        {
+            uint32_t name_length;
+
+            if (table + sizeof(name_length) > end)
+                datasetError(path, "truncated name table");
+            memcpy(&name_length, table, sizeof(name_length));
+            table += sizeof(name_length);
+
+            if (table + name_length > end)
+                datasetError(path, "truncated name table");
+            points.internName(std::string(table, name_length));
+            table += name_length;
+        }
+
+        for (int i = 0; i < total_points; i++)
+        {
+            if (name_ids[i] >= total_names)
+                datasetError(path, "invalid name index");
+            points.setNameID(i, name_ids[i]);
+        }
+    }
+
+    return points;
+}
+
+// --input: a binary dataset is mapped, anything else is read as text (and
+// narrowed after parsing when single_precision is set)
+inline PointMatrix loadDataset(const std::string &path, int &K, int &max_iterations, bool single_precision = false)
+{
+    if (isBinaryDataset(path))
+        return loadBinaryDataset(path, K, max_iterations, single_precision);
+
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+        datasetError(path, "cannot open the dataset file");
+
+    PointMatrix points = readTextDataset(file, K, max_iterations);
+    fclose(file);
+
+    if (single_precision)
+        points.convertToFloat();
+    return points;
+}
+
+inline bool writeBinaryDataset(const std::string &path, const PointMatrix &points, int K, int max_iterations,
+                               DatasetValueType value_type = DATASET_FLOAT64)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+        return false;
+
+    int total_points = points.getTotalPoints(), total_values = points.getTotalValues();
+    std::size_t total = (std::size_t)total_points * total_values;
+    std::size_t value_size = value_type == DATASET_FLOAT32 ? sizeof(float) : sizeof(double);
+
+    DatasetHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, DATASET_MAGIC, 8);
+    header.version = DATASET_VERSION;
+    header.value_type = value_type;
+    header.total_points = total_points;
+    header.total_values = total_values;
+    header.K = K;
+    header.max_iterations = max_iterations;
+    header.has_name = points.hasName();
+    header.values_offset = sizeof(DatasetHeader);
+    header.names_offset = points.hasName() ? header.values_offset + total * value_size : 0;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+
+    if (value_type == DATASET_FLOAT64)
+        ok = ok && fwrite(points.data(), sizeof(double), total, file) == total;
+    else
+    {
+        std::vector<float> narrow(points.data(), points.data() + total);
+        ok = ok && fwrite(narrow.data(), sizeof(float), total, file) == total;
+    }
+
+    if (points.hasName())
+    {
+        std::vector<uint32_t> name_ids(total_points);
+        const std::vector<std::string> &table = points.getNameTable();
+        uint32_t total_names = table.size();
+
+        for (int i = 0; i < total_points; i++)
+            name_ids[i] = points.getNameID(i);
+
+        ok = ok && fwrite(name_ids.data(), sizeof(uint32_t), total_points, file) == (std::size_t)total_points;
+        ok = ok && fwrite(&total_names, sizeof(total_names), 1, file) == 1;
+
+        for (const std::string &name : table)
+        {
+            uint32_t name_length = name.size();
+
+            ok = ok && fwrite(&name_length, sizeof(name_length), 1, file) == 1;
+            ok = ok && fwrite(name.data(), 1, name_length, file) == name_length;
+        }
+    }
+
+    return fclose(file) == 0 && ok;
+}
+
+#endif
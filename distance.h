@@ -0,0 +1,436 @@
+// Squared euclidean distance kernels for the assignment step.
+//
+// The centroids are repacked into blocks of W lanes, W being the number of
+// values of type T in a register (64 bytes for AVX-512, 32 bytes for AVX2
+// and for the scalar fallback): coordinate j of centroid b * W + l is stored
+// at blocks[(b * total_values + j) * W + l]. One point is then compared
+// against W centroids at once, broadcasting each coordinate of the point
+// and subtracting a whole row of the block. Distances are compared squared,
+// so no sqrt is needed to find the nearest center.
+//
+// The kernels and CenterBlocks are templates on the scalar type: double, or
+// float for --precision float, where a register holds twice as many lanes
+// and the memory traffic of the assignment is halved.
+//
+// The instruction set is chosen at runtime (CPU dispatch), so the same
+// binary runs on machines without AVX2/AVX-512. Every kernel is a template
+// on the dimensionality: the common values of D (2, 4, 8, 16 and 32) get
+// their own instantiation, where the loop over the coordinates has a
+// compile-time trip count and is fully unrolled; D = 0 is the generic
+// version that reads total_values at runtime.
+
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "point_matrix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KMEANS_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+inline SimdLevel detectSimdLevel()
+{
+#ifdef KMEANS_X86_DISPATCH
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx512f"))
+        return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return SIMD_AVX2;
+#endif
+    return SIMD_SCALAR;
+}
+
+// "auto" picks the best level supported by the CPU; an explicit level is
+// only honoured when the CPU supports it
+inline SimdLevel parseSimdLevel(const std::string &name)
+{
+    SimdLevel best = detectSimdLevel();
+
+    if (name == "scalar")
+        return SIMD_SCALAR;
+    if (name == "avx2" && best >= SIMD_AVX2)
+        return SIMD_AVX2;
+    if (name == "avx512" && best >= SIMD_AVX512)
+        return SIMD_AVX512;
+    return best;
+}
+
+inline const char *simdLevelName(SimdLevel level)
+{
+    switch (level)
+    {
+    case SIMD_AVX512:
+        return "avx512";
+    case SIMD_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+// signature shared by every kernel: returns the index of the nearest centroid
+// and stores its squared distance in *min_distance
+template <typename T>
+using NearestCenterKernel = int (*)(const T *point, const T *blocks, int total_blocks, int total_values, int K,
+                                    T *min_distance);
+
+// keeps the nearest of the valid lanes of block b (the last block may be
+// partly filled); ties keep the lowest index
+template <typename T, int W>
+inline void keepNearest(const T *dist, int b, int K, T &best, int &id_best)
+{
+    int lanes = K - b * W < W ? K - b * W : W;
+
+    for (int l = 0; l < lanes; l++)
+    {
+        if (dist[l] < best)
+        {
+            best = dist[l];
+            id_best = b * W + l;
+        }
+    }
+}
+
+template <typename T, int D>
+inline int nearestCenterScalar(const T *point, const T *blocks, int total_blocks,
+                               int total_values, int K, T *min_distance)
+{
+    const int W = 32 / sizeof(T);
+    const int dims = D > 0 ? D : total_values;
+    T best = std::numeric_limits<T>::max();
+    int id_best = 0;
+
+    for (int b = 0; b < total_blocks; b++)
+    {
+        const T *block = blocks + (std::size_t)b * dims * W;
+        T dist[W] = {};
+
+        for (int j = 0; j < dims; j++)
+        {
+            for (int l = 0; l < W; l++)
+            {
+                T diff = point[j] - block[j * W + l];
+                dist[l] += diff * diff;
+            }
+        }
+
+        keepNearest<T, W>(dist, b, K, best, id_best);
+    }
+
+    *min_distance = best;
+    return id_best;
+}
+
+#ifdef KMEANS_X86_DISPATCH
+// the register operations of the SIMD kernels for each scalar type:
+// addSquaredDiff returns acc + (point_value - row)^2, lane by lane
+template <typename T>
+struct Avx2Vector;
+
+template <>
+struct Avx2Vector<double>
+{
+    typedef __m256d Type;
+    static const int width = 4;
+
+    __attribute__((target("avx2,fma"))) static Type zero()
+    {
+        return _mm256_setzero_pd();
+    }
+
+    __attribute__((target("avx2,fma"))) static Type addSquaredDiff(Type acc, double point_value, const double *row)
+    {
+        __m256d diff = _mm256_sub_pd(_mm256_set1_pd(point_value), _mm256_load_pd(row));
+        return _mm256_fmadd_pd(diff, diff, acc);
+    }
+
+    __attribute__((target("avx2,fma"))) static void store(double *dist, Type acc)
+    {
+        _mm256_store_pd(dist, acc);
+    }
+};
+
+template <>
+struct Avx2Vector<float>
+{
+    typedef __m256 Type;
+    static const int width = 8;
+
+    __attribute__((target("avx2,fma"))) static Type zero()
+    {
+        return _mm256_setzero_ps();
+    }
+
+    __attribute__((target("avx2,fma"))) static Type addSquaredDiff(Type acc, float point_value, const float *row)
+    {
+        __m256 diff = _mm256_sub_ps(_mm256_set1_ps(point_value), _mm256_load_ps(row));
+        return _mm256_fmadd_ps(diff, diff, acc);
+    }
+
+    __attribute__((target("avx2,fma"))) static void store(float *dist, Type acc)
+    {
+        _mm256_store_ps(dist, acc);
+    }
+};
+
+template <typename T>
+struct Avx512Vector;
+
+template <>
+struct Avx512Vector<double>
+{
+    typedef __m512d Type;
+    static const int width = 8;
+
+    __attribute__((target("avx512f"))) static Type zero()
+    {
+        return _mm512_setzero_pd();
+    }
+
+    __attribute__((target("avx512f"))) static Type addSquaredDiff(Type acc, double point_value, const double *row)
+    {
+        __m512d diff = _mm512_sub_pd(_mm512_set1_pd(point_value), _mm512_load_pd(row));
+        return _mm512_fmadd_pd(diff, diff, acc);
+    }
+
+    __attribute__((target("avx512f"))) static void store(double *dist, Type acc)
+    {
+        _mm512_store_pd(dist, acc);
+    }
+};
+
+template <>
+struct Avx512Vector<float>
+{
+    typedef __m512 Type;
+    static const int width = 16;
+
+    __attribute__((target("avx512f"))) static Type zero()
+    {
+        return _mm512_setzero_ps();
+    }
+
+    __attribute__((target("avx512f"))) static Type addSquaredDiff(Type acc, float point_value, const float *row)
+    {
+        __m512 diff = _mm512_sub_ps(_mm512_set1_ps(point_value), _mm512_load_ps(row));
+        return _mm512_fmadd_ps(diff, diff, acc);
+    }
+
+    __attribute__((target("avx512f"))) static void store(float *dist, Type acc)
+    {
+        _mm512_store_ps(dist, acc);
+    }
+};
+
+template <typename T, int D>
+__attribute__((target("avx2,fma"))) inline int nearestCenterAvx2(const T *point, const T *blocks, int total_blocks,
+                                                                   int total_values, int K, T *min_distance)
+{
+    typedef Avx2Vector<T> Vector;
+    const int W = Vector::width;
+    const int dims = D > 0 ? D : total_values;
+    T best = std::numeric_limits<T>::max();
+    int id_best = 0;
+    alignas(32) T dist[W];
+
+    for (int b = 0; b < total_blocks; b++)
+    {
+        const T *block = blocks + (std::size_t)b * dims * W;
+        typename Vector::Type acc = Vector::zero();
+
+        for (int j = 0; j < dims; j++)
+            acc = Vector::addSquaredDiff(acc, point[j], block + j * W);
+
+        Vector::store(dist, acc);
+        keepNearest<T, W>(dist, b, K, best, id_best);
+    }
+
+    *min_distance = best;
+    return id_best;
+}
+
+template <typename T, int D>
+__attribute__((target("avx512f"))) inline int nearestCenterAvx512(const T *point, const T *blocks, int total_blocks,
+                                                                    int total_values, int K, T *min_distance)
+{
+    typedef Avx512Vector<T> Vector;
+    const int W = Vector::width;
+    const int dims = D > 0 ? D : total_values;
+    T best = std::numeric_limits<T>::max();
+    int id_best = 0;
+    alignas(64) T dist[W];
+
+    for (int b = 0; b < total_blocks; b++)
+    {
+        const T *block = blocks + (std::size_t)b * dims * W;
+        typename Vector::Type acc = Vector::zero();
+
+        for (int j = 0; j < dims; j++)
+            acc = Vector::addSquaredDiff(acc, point[j], block + j * W);
+
+        Vector::store(dist, acc);
+        keepNearest<T, W>(dist, b, K, best, id_best);
+    }
+
+    *min_distance = best;
+    return id_best;
+}
+#endif
+
+// picks the instantiation of a kernel family for the dimensionality
+template <template <int> class Family>
+inline typename std::decay<decltype(Family<0>::kernel)>::type selectForDimension(int total_values)
+{
+    switch (total_values)
+    {
+    case 2:
+        return Family<2>::kernel;
+    case 4:
+        return Family<4>::kernel;
+    case 8:
+        return Family<8>::kernel;
+    case 16:
+        return Family<16>::kernel;
+    case 32:
+        return Family<32>::kernel;
+    default:
+        return Family<0>::kernel;
+    }
+}
+
+template <typename T>
+struct ScalarKernels
+{
+    template <int D>
+    struct Family
+    {
+        static constexpr NearestCenterKernel<T> kernel = nearestCenterScalar<T, D>;
+    };
+};
+
+#ifdef KMEANS_X86_DISPATCH
+template <typename T>
+struct Avx2Kernels
+{
+    template <int D>
+    struct Family
+    {
+        static constexpr NearestCenterKernel<T> kernel = nearestCenterAvx2<T, D>;
+    };
+};
+
+template <typename T>
+struct Avx512Kernels
+{
+    template <int D>
+    struct Family
+    {
+        static constexpr NearestCenterKernel<T> kernel = nearestCenterAvx512<T, D>;
+    };
+};
+#endif
+
+// centroids packed for the kernels above; CenterBlocks for the double
+// points, FloatCenterBlocks for --precision float
+template <typename T>
+class BasicCenterBlocks
+{
+private:
+    int K, total_values, width, total_blocks;
+    SimdLevel level;
+    NearestCenterKernel<T> kernel;
+    std::vector<T, AlignedAllocator<T>> blocks;
+
+public:
+    BasicCenterBlocks(int K = 0, int total_values = 0, SimdLevel level = detectSimdLevel())
+    {
+        this->K = K;
+        this->total_values = total_values;
+        this->level = level;
+
+        width = 32 / sizeof(T);
+        kernel = selectForDimension<ScalarKernels<T>::template Family>(total_values);
+#ifdef KMEANS_X86_DISPATCH
+        if (level == SIMD_AVX512)
+        {
+            width = Avx512Vector<T>::width;
+            kernel = selectForDimension<Avx512Kernels<T>::template Family>(total_values);
+        }
+        else if (level == SIMD_AVX2)
+            kernel = selectForDimension<Avx2Kernels<T>::template Family>(total_values);
+#endif
+
+        total_blocks = (K + width - 1) / width;
+        blocks.assign((std::size_t)total_blocks * total_values * width, T(0));
+    }
+
+    // the centroids stay in double in the clusters; with T = float they are
+    // rounded here
+    void setCenter(int id_cluster, const double *values)
+    {
+        int b = id_cluster / width, l = id_cluster % width;
+        T *block = &blocks[(std::size_t)b * total_values * width];
+
+        for (int j = 0; j < total_values; j++)
+            block[j * width + l] = values[j];
+    }
+
+    int nearest(const T *point, T *min_distance) const
+    {
+        return kernel(point, blocks.data(), total_blocks, total_values, K, min_distance);
+    }
+
+    int nearest(const T *point) const
+    {
+        T min_distance;
+        return kernel(point, blocks.data(), total_blocks, total_values, K, &min_distance);
+    }
+
+    // nearest among the centroids of the blocks [first_block, first_block +
+    // count), used to compare a tile of points with a tile of centroids
+    int nearestInRange(const T *point, int first_block, int count, T *min_distance) const
+    {
+        int first_center = first_block * width;
+
+        return first_center + kernel(point, blocks.data() + (std::size_t)first_block * total_values * width, count,
+                                     total_values, K - first_center, min_distance);
+    }
+
+    int getTotalBlocks() const
+    {
+        return total_blocks;
+    }
+
+    // number of blocks that fit in the given number of bytes (at least one)
+    int blocksPerTile(std::size_t bytes) const
+    {
+        std::size_t block_bytes = (std::size_t)total_values * width * sizeof(T);
+        int count = block_bytes > 0 ? bytes / block_bytes : total_blocks;
+
+        return count < 1 ? 1 : count;
+    }
+
+    SimdLevel getLevel() const
+    {
+        return level;
+    }
+};
+
+typedef BasicCenterBlocks<double> CenterBlocks;
+typedef BasicCenterBlocks<float> FloatCenterBlocks;
+
+#endif
@@ -0,0 +1,247 @@
+// Assignment step as a matrix product, for large K and D.
+//
+// The squared distance is expanded as ||x||^2 - 2 x.c + ||c||^2. Since
+// ||x||^2 is the same for every center, the nearest center of x is the one
+// with the smallest ||c||^2 - 2 x.c, so the work is the product of a tile of
+// points with the K centers (a GEMM) followed by an argmin over each row.
+//
+// The product is cache blocked: the centers are packed in panels of 8
+// (coordinate j of center p * 8 + l at panels[(p * total_values + j) * 8 + l],
+// the layout of CenterBlocks), a panel stays in L1 while it is multiplied
+// with every point of the tile (the tile stays in L2), and a register
+// blocked micro-kernel computes 4 points x 8 centers at a time. The argmin
+// is fused: after each panel only the best score of every point is kept,
+// the K dot products are never stored.
+//
+// Compiled with -DKMEANS_USE_BLAS (and linked with a CBLAS library, e.g.
+// -lopenblas), the product of a tile with all the centers is done by
+// cblas_dgemm instead, followed by the same argmin; the tile_points * K
+// products go to a scratch buffer of the calling thread, allocated with the
+// assigner.
+//
+// The expanded form rounds differently from the direct difference, so on a
+// near tie a point can get a different (equally near) center than with the
+// kernels of distance.h.
+
+#ifndef GEMM_ASSIGN_H
+#define GEMM_ASSIGN_H
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <string>
+#include <vector>
+
+#ifdef KMEANS_USE_BLAS
+#include <cblas.h>
+#endif
+
+#include "distance.h"
+#include "point_matrix.h"
+
+// --assign auto needs at least this many values per point: below it the
+// micro-kernel does too few FMAs per panel load. Measured with kmeans_bench
+// (N = 50000, 10 iterations, 1 thread, Mpoints/s direct / gemm): D = 4 never
+// gains (K = 1024: 0.47 / 0.42, K = 4096: 0.14 / 0.15), D = 8 breaks even at
+// K = 512 (0.74 / 0.75) and gains from K = 1024 (0.42 / 0.50), and from
+// D = 16 the GEMM engine is ahead once K * D >= 4096 (D = 16, K = 256:
+// 1.06 / 1.37; D = 64, K = 64: 1.23 / 2.12; D = 128, K = 256: 0.16 / 0.43).
+static const int gemm_min_values = 8;
+
+// --assign: "gemm", "direct" (the kernels of distance.h) or "auto", which
+// picks the GEMM engine once K * total_values reaches the threshold and
+// there are at least gemm_min_values values per point
+inline bool useGemmAssignment(const std::string &mode, int K, int total_values, long long threshold)
+{
+    if (mode == "gemm")
+        return true;
+    if (mode == "direct")
+        return false;
+    return total_values >= gemm_min_values && (long long)K * total_values >= threshold;
+}
+
+// dots[p * 8 + l] = point p of the 4 rows . center l of the panel
+inline void gemmMicroKernelScalar(const double *rows, int total_rows, int total_values, const double *panel, double *dots)
+{
+    for (int p = 0; p < 4 * 8; p++)
+        dots[p] = 0.0;
+
+    for (int j = 0; j < total_values; j++)
+    {
+        const double *column = panel + j * 8;
+
+        for (int p = 0; p < total_rows; p++)
+        {
+            double x = rows[(std::size_t)p * total_values + j];
+
+            for (int l = 0; l < 8; l++)
+                dots[p * 8 + l] += x * column[l];
+        }
+    }
+}
+
+#ifdef KMEANS_X86_DISPATCH
+__attribute__((target("avx2,fma"))) inline void gemmMicroKernelAvx2(const double *rows, int total_rows, int total_values,
+                                                                      const double *panel, double *dots)
+{
+    // 4 points x 8 centers in 8 accumulators
+    __m256d acc[4][2];
+
+    for (int p = 0; p < 4; p++)
+        acc[p][0] = acc[p][1] = _mm256_setzero_pd();
+
+    const double *row0 = rows;
+    const double *row1 = rows + (std::size_t)(total_rows > 1 ? 1 : 0) * total_values;
+    const double *row2 = rows + (std::size_t)(total_rows > 2 ? 2 : 0) * total_values;
+    const double *row3 = rows + (std::size_t)(total_rows > 3 ? 3 : 0) * total_values;
+
+    for (int j = 0; j < total_values; j++)
+    {
+        __m256d low = _mm256_load_pd(panel + j * 8), high = _mm256_load_pd(panel + j * 8 + 4);
+        __m256d x0 = _mm256_set1_pd(row0[j]), x1 = _mm256_set1_pd(row1[j]);
+        __m256d x2 = _mm256_set1_pd(row2[j]), x3 = _mm256_set1_pd(row3[j]);
+
+        acc[0][0] = _mm256_fmadd_pd(x0, low, acc[0][0]);
+        acc[0][1] = _mm256_fmadd_pd(x0, high, acc[0][1]);
+        acc[1][0] = _mm256_fmadd_pd(x1, low, acc[1][0]);
+        acc[1][1] = _mm256_fmadd_pd(x1, high, acc[1][1]);
+        acc[2][0] = _mm256_fmadd_pd(x2, low, acc[2][0]);
+        acc[2][1] = _mm256_fmadd_pd(x2, high, acc[2][1]);
+        acc[3][0] = _mm256_fmadd_pd(x3, low, acc[3][0]);
+        acc[3][1] = _mm256_fmadd_pd(x3, high, acc[3][1]);
+    }
+
+    for (int p = 0; p < 4; p++)
+    {
+        _mm256_storeu_pd(dots + p * 8, acc[p][0]);
+        _mm256_storeu_pd(dots + p * 8 + 4, acc[p][1]);
+    }
+}
+#endif
+
+class GemmAssigner
+{
+private:
+    int K, total_values, total_panels;
+    bool use_avx2;
+    AlignedVector panels;     // centers packed in panels of 8
+    std::vector<double> norms; // ||c||^2, +infinity for the padding lanes
+#ifdef KMEANS_USE_BLAS
+    std::vector<double> centers;  // K * total_values, row-major, for cblas_dgemm
+    mutable AlignedVector scratch; // tile_points * K products per thread
+#endif
+
+public:
+    // points per tile: 64 rows of up to a few hundred values stay in L2
+    static const int tile_points = 64;
+
+    // total_threads: number of threads that call assignTile at the same time
+    GemmAssigner(int K = 0, int total_values = 0, SimdLevel level = detectSimdLevel(), int total_threads = 1)
+    {
+        this->K = K;
+        this->total_values = total_values;
+        use_avx2 = level >= SIMD_AVX2;
+
+        total_panels = (K + 7) / 8;
+        panels.assign((std::size_t)total_panels * total_values * 8, 0.0);
+        norms.assign((std::size_t)total_panels * 8, std::numeric_limits<double>::infinity());
+#ifdef KMEANS_USE_BLAS
+        centers.assign((std::size_t)K * total_values, 0.0);
+        scratch.resize((std::size_t)total_threads * tile_points * K);
+#endif
+    }
+
+    void setCenter(int id_cluster, const double *values)
+    {
+        double *panel = &panels[(std::size_t)(id_cluster / 8) * total_values * 8];
+        int l = id_cluster % 8;
+        double norm = 0.0;
+
+        for (int j = 0; j < total_values; j++)
+        {
+            panel[j * 8 + l] = values[j];
+            norm += values[j] * values[j];
+        }
+
+        norms[id_cluster] = norm;
+#ifdef KMEANS_USE_BLAS
+        std::copy(values, values + total_values, &centers[(std::size_t)id_cluster * total_values]);
+#endif
+    }
+
+    // labels the total_rows (<= tile_points) consecutive rows starting at
+    // rows; thread is the index of the caller (< total_threads)
+    void assignTile(const double *rows, int total_rows, int *labels, int thread = 0) const
+    {
+        double best[tile_points];
+        int id_best[tile_points];
+
+        for (int p = 0; p < total_rows; p++)
+        {
+            best[p] = std::numeric_limits<double>::max();
+            id_best[p] = 0;
+        }
+
+#ifdef KMEANS_USE_BLAS
+        double *dots = &scratch[(std::size_t)thread * tile_points * K];
+
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, total_rows, K, total_values, 1.0, rows, total_values,
+                    centers.data(), total_values, 0.0, dots, K);
+
+        for (int p = 0; p < total_rows; p++)
+        {
+            for (int c = 0; c < K; c++)
+            {
+                double score = norms[c] - 2.0 * dots[(std::size_t)p * K + c];
+
+                if (score < best[p])
+                {
+                    best[p] = score;
+                    id_best[p] = c;
+                }
+            }
+        }
+#else
+        alignas(64) double dots[4 * 8];
+
+        for (int panel = 0; panel < total_panels; panel++)
+        {
+            const double *block = &panels[(std::size_t)panel * total_values * 8];
+            const double *panel_norms = &norms[(std::size_t)panel * 8];
+
+            for (int p0 = 0; p0 < total_rows; p0 += 4)
+            {
+                int micro_rows = std::min(4, total_rows - p0);
+                const double *micro = rows + (std::size_t)p0 * total_values;
+
+#ifdef KMEANS_X86_DISPATCH
+                if (use_avx2)
+                    gemmMicroKernelAvx2(micro, micro_rows, total_values, block, dots);
+                else
+#endif
+                    gemmMicroKernelScalar(micro, micro_rows, total_values, block, dots);
+
+                // fused argmin over the 8 centers of the panel
+                for (int p = 0; p < micro_rows; p++)
+                {
+                    for (int l = 0; l < 8; l++)
+                    {
+                        double score = panel_norms[l] - 2.0 * dots[p * 8 + l];
+
+                        if (score < best[p0 + p])
+                        {
+                            best[p0 + p] = score;
+                            id_best[p0 + p] = panel * 8 + l;
+                        }
+                    }
+                }
+            }
+        }
+#endif
+
+        for (int p = 0; p < total_rows; p++)
+            labels[p] = id_best[p];
+    }
+};
+
+#endif
@@ -0,0 +1,185 @@
+// Hamerly's accelerated assignment step.
+//
+// Every point keeps an upper bound on the distance to its assigned center
+// and a lower bound on the distance to the second closest one. After each
+// centroid update the bounds are loosened by how far the centers moved, and
+// a point whose upper bound is still below max(lower bound, half of the
+// distance from its center to the nearest other center) cannot have changed
+// cluster, so its K distances are skipped. The labels produced are the same
+// as the ones of the exact (Lloyd) assignment.
+//
+// Distances here are real euclidean distances (not squared), because the
+// bounds are moved with the triangle inequality.
+
+#ifndef HAMERLY_H
+#define HAMERLY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+class HamerlyBounds
+{
+private:
+    int K, total_values;
+    std::vector<double> upper, lower;           // per point
+    std::vector<double> centers, old_centers;   // K * total_values, row-major
+    std::vector<double> drift, half_min_distance; // per center
+    double max_drift, second_max_drift;
+    int id_max_drift;
+    bool has_centers; // false until the first finishCenters
+
+    double distance(const double *a, const double *b) const
+    {
+        double sum = 0.0;
+
+        for (int j = 0; j < total_values; j++)
+        {
+            double diff = a[j] - b[j];
+            sum += diff * diff;
+        }
+
+        return std::sqrt(sum);
+    }
+
+public:
+    HamerlyBounds(int total_points = 0, int K = 0, int total_values = 0)
+    {
+        this->K = K;
+        this->total_values = total_values;
+
+        // an infinite upper bound forces the full scan on the first assignment
+        upper.assign(total_points, std::numeric_limits<double>::infinity());
+        lower.assign(total_points, 0.0);
+        centers.assign((std::size_t)K * total_values, 0.0);
+        old_centers = centers;
+        drift.assign(K, 0.0);
+        half_min_distance.assign(K, 0.0);
+        max_drift = second_max_drift = 0.0;
+        id_max_drift = -1;
+        has_centers = false;
+    }
+
+    void setCenter(int id_cluster, const double *values)
+    {
+        double *center = &centers[(std::size_t)id_cluster * total_values];
+
+        for (int j = 0; j < total_values; j++)
+            center[j] = values[j];
+    }
+
+    // called once per centroid update, after every setCenter: measures how far
+    // each center moved and the half distance to its nearest neighbour center
+    void finishCenters()
+    {
+        for (int c = 0; c < K; c++)
+            measureCenter(c);
+
+        finishDrift();
+    }
+
+    // the two halves of finishCenters, for a caller that spreads the centers
+    // over threads: measureCenter for every center (independent of each
+    // other), then finishDrift once
+    void measureCenter(int c)
+    {
+        const double *center = &centers[(std::size_t)c * total_values];
+
+        drift[c] = !has_centers ? 0.0 : distance(center, &old_centers[(std::size_t)c * total_values]);
+
+        double min_distance = std::numeric_limits<double>::infinity();
+
+        for (int o = 0; o < K; o++)
+        {
+            if (o != c)
+            {
+                double d = distance(center, &centers[(std::size_t)o * total_values]);
+
+                if (d < min_distance)
+                    min_distance = d;
+            }
+        }
+
+        half_min_distance[c] = 0.5 * min_distance;
+    }
+
+    void finishDrift()
+    {
+        max_drift = second_max_drift = 0.0;
+        id_max_drift = -1;
+
+        for (int c = 0; c < K; c++)
+        {
+            if (drift[c] > max_drift)
+            {
+                second_max_drift = max_drift;
+                max_drift = drift[c];
+                id_max_drift = c;
+            }
+            else if (drift[c] > second_max_drift)
+                second_max_drift = drift[c];
+        }
+
+        old_centers = centers;
+        has_centers = true;
+    }
+
+    // returns the nearest center of the point stored at position index,
+    // given the center it was assigned to in the previous iteration
+    int assign(int index, const double *point, int id_cluster)
+    {
+        // the bounds are loosened lazily, once per iteration, by the drift of
+        // the last centroid update
+        if (id_cluster >= 0 && id_cluster < K)
+        {
+            upper[index] += drift[id_cluster];
+            lower[index] -= id_cluster == id_max_drift ? second_max_drift : max_drift;
+
+            double bound = std::max(half_min_distance[id_cluster], lower[index]);
+
+            // strict comparison: on a tie the exact assignment could prefer a
+            // center with a lower index
+            if (upper[index] < bound)
+                return id_cluster;
+
+            // tighten the upper bound and test again before the full scan
+            upper[index] = distance(point, &centers[(std::size_t)id_cluster * total_values]);
+
+            if (upper[index] < bound)
+                return id_cluster;
+        }
+
+        // full scan, keeping the closest and the second closest distances
+        double best = std::numeric_limits<double>::max(), second = std::numeric_limits<double>::max();
+        int id_best = 0;
+
+        for (int c = 0; c < K; c++)
+        {
+            const double *center = &centers[(std::size_t)c * total_values];
+            double sum = 0.0;
+
+            for (int j = 0; j < total_values; j++)
+            {
+                double diff = point[j] - center[j];
+                sum += diff * diff;
+            }
+
+            if (sum < best)
+            {
+                second = best;
+                best = sum;
+                id_best = c;
+            }
+            else if (sum < second)
+                second = sum;
+        }
+
+        upper[index] = std::sqrt(best);
+        lower[index] = std::sqrt(second);
+        return id_best;
+    }
+};
+
+#endif
@@ -0,0 +1,152 @@
+// Per-iteration trace of a run (--trace file), compiled in with
+// -DKMEANS_TRACE.
+//
+// Every iteration records the time of its phases in nanoseconds (the laps
+// of the PhaseClock of phase_times.h), the number of points that changed
+// cluster, the inertia (sum of the squared distances of the points to the
+// center they were assigned to in that iteration) and the largest distance
+// a center moved in the update, both measured by the ConvergenceCheck of
+// convergence.h. The MPI version adds the time of the reduction between the
+// ranks and the load imbalance of the assignment, max / mean - 1 of the
+// per-rank times; the per-rank times are only combined once, after the last
+// iteration, so tracing adds no message to the loop.
+//
+// The records stay in memory and are written when the run ends, one line
+// per iteration after a two line header:
+//
+//   # kmeans trace: version=omp points=N values=D K=K threads=T ranks=R
+//   # iteration assign_ns update_ns communicate_ns changed inertia max_shift imbalance
+//
+// Without KMEANS_TRACE every method below is empty and enabled() is a
+// constant false, so the code guarded by it is removed by the compiler.
+
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct IterationRecord
+{
+    int iteration = 0;
+    long long assign_ns = 0, update_ns = 0, communicate_ns = 0;
+    long long changed = 0;
+    double inertia = 0.0;
+    double max_shift = 0.0;
+    double imbalance = 0.0; // MPI only
+};
+
+inline long long toNanoseconds(double seconds)
+{
+    return (long long)(seconds * 1e9 + 0.5);
+}
+
+#ifdef KMEANS_TRACE
+
+class IterationTrace
+{
+private:
+    bool active;
+    std::string path, header;
+    std::vector<IterationRecord> records;
+
+public:
+    IterationTrace()
+    {
+        active = false;
+    }
+
+    // starts recording when path is not empty; the file is only written by
+    // the caller with write_file (rank 0 in the MPI version)
+    void start(const std::string &path, bool write_file, const std::string &version, long long total_points,
+               int total_values, int K, int threads, int ranks)
+    {
+        if (path.empty())
+            return;
+
+        active = true;
+        this->path = write_file ? path : "";
+
+        header = "# kmeans trace: version=" + version + " points=" + std::to_string(total_points) +
+                 " values=" + std::to_string(total_values) + " K=" + std::to_string(K) +
+                 " threads=" + std::to_string(threads) + " ranks=" + std::to_string(ranks) + "\n";
+    }
+
+    bool enabled() const
+    {
+        return active;
+    }
+
+    void addIteration(const IterationRecord &record)
+    {
+        records.push_back(record);
+    }
+
+    std::vector<IterationRecord> &getRecords()
+    {
+        return records;
+    }
+
+    void write()
+    {
+        if (!active || path.empty())
+            return;
+
+        FILE *file = fopen(path.c_str(), "w");
+
+        if (!file)
+        {
+            std::cerr << path << ": cannot write the trace\n";
+            return;
+        }
+
+        fputs(header.c_str(), file);
+        fputs("# iteration assign_ns update_ns communicate_ns changed inertia max_shift imbalance\n", file);
+
+        for (const IterationRecord &record : records)
+            fprintf(file, "%d %lld %lld %lld %lld %.17g %.17g %.6f\n", record.iteration, record.assign_ns,
+                    record.update_ns, record.communicate_ns, record.changed, record.inertia, record.max_shift,
+                    record.imbalance);
+
+        fclose(file);
+    }
+};
+
+#else
+
+class IterationTrace
+{
+private:
+    std::vector<IterationRecord> records; // always empty
+
+public:
+    void start(const std::string &path, bool write_file, const std::string &, long long, int, int, int, int)
+    {
+        if (!path.empty() && write_file)
+            std::cerr << "--trace ignored: compile with -DKMEANS_TRACE to record the iterations\n";
+    }
+
+    constexpr bool enabled() const
+    {
+        return false;
+    }
+
+    void addIteration(const IterationRecord &)
+    {
+    }
+
+    std::vector<IterationRecord> &getRecords()
+    {
+        return records;
+    }
+
+    void write()
+    {
+    }
+};
+
+#endif
+
+#endif
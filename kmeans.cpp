@@ -10,261 +10,433 @@
 #include <chrono>
 #include <omp.h>
 
+#include "accumulate.h"
+#include "convergence.h"
+#include "dataset_file.h"
+#include "distance.h"
+#include "gemm_assign.h"
+#include "hamerly.h"
+#include "instrumentation.h"
+#include "kmeans_model.h"
+#include "minibatch.h"
+#include "options.h"
+#include "phase_times.h"
+#include "point_matrix.h"
+#include "seeding.h"
+
 
 using namespace std;
 
-class Point
+class Cluster
 {
 private:
-	int id_point, id_cluster;
-	vector<double> values;
-	int total_values;
-	string name;
+	int id_cluster;
+	vector<double> central_values;
+	vector<int> points; // indexes of the member points in the PointMatrix
 
 public:
-	Point(int id_point, vector<double> &values, string name = "")
+	Cluster(int id_cluster, const double *values, int total_values)
 	{
-		this->id_point = id_point;
-		total_values = values.size();
+		this->id_cluster = id_cluster;
 
 		for (int i = 0; i < total_values; i++)
-			this->values.push_back(values[i]);
+			central_values.push_back(values[i]);
+	}
 
-		this->name = name;
-		id_cluster = -1;
+	// positions[id_point] records the slot of each point inside the member
+	// list of its cluster, so removal does not need to search the list
+	void addPoint(int id_point, vector<int> &positions)
+	{
+		positions[id_point] = points.size();
+		points.push_back(id_point);
 	}
 
-	int getID()
+	// O(1) removal: the last member is moved into the slot of the removed one
+	bool removePoint(int id_point, vector<int> &positions)
 	{
-		return id_point;
+		int position = positions[id_point];
+
+		if (position < 0 || position >= (int)points.size() || points[position] != id_point)
+			return false;
+
+		int id_last_point = points.back();
+
+		points[position] = id_last_point;
+		positions[id_last_point] = position;
+		points.pop_back();
+		positions[id_point] = -1;
+		return true;
 	}
 
-	void setCluster(int id_cluster)
+	double getCentralValue(int index)
 	{
-		this->id_cluster = id_cluster;
+		return central_values[index];
 	}
 
-	int getCluster()
+	void setCentralValue(int index, double value)
 	{
-		return id_cluster;
+		central_values[index] = value;
 	}
 
-	double getValue(int index)
+	const double *getCentralValues()
 	{
-		return values[index];
+		return central_values.data();
 	}
 
-	int getTotalValues()
+	int getPoint(int index)
 	{
-		return total_values;
+		return points[index];
 	}
 
-	void addValue(double value)
+	int getTotalPoints()
 	{
-		values.push_back(value);
+		return points.size();
 	}
 
-	string getName()
+	int getID()
 	{
-		return name;
+		return id_cluster;
 	}
 };
 
-class Cluster
+class KMeans
 {
 private:
-	int id_cluster;
-	vector<double> central_values;
-	vector<Point> points;
-
-public:
-	Cluster(int id_cluster, Point point)
+	int K; // number of clusters
+	int total_values, total_points, max_iterations;
+	Options options;
+	mt19937_64 rng; // seeded with options.seed, used by every random choice
+	vector<Cluster> clusters;
+	CenterBlocks center_blocks;
+	AccumulateKernel accumulate; // fixed-dimension accumulation loop (accumulate.h)
+	HamerlyBounds bounds;        // used with --hamerly
+	GemmAssigner gemm;           // blocked GEMM assignment for large K * D (gemm_assign.h)
+	bool use_gemm;
+	vector<int> nearest_labels;  // labels computed by gemm at the start of an iteration
+	vector<int> positions; // slot of each point in its cluster's member list
+	vector<double> sums; // per-cluster sum of the member coordinates (K * total_values)
+	vector<int> counts;  // per-cluster number of members
+	PhaseTimes times;    // --phase-times
+	IterationTrace trace; // --trace
+	ConvergenceCheck convergence; // --tol-shift, --tol-inertia, --tol-changed
+	vector<double> initial_centers; // --warm-start, replaces the seeding when set
+	double final_inertia;  // of the last assignment, 0 when it was not measured
+
+	// return ID of nearest center (compares squared euclidean distances with
+	// the SIMD kernel selected at runtime, see distance.h)
+	int getIDNearestCenter(const double *point)
 	{
-		this->id_cluster = id_cluster;
-
-		int total_values = point.getTotalValues();
-
-		for (int i = 0; i < total_values; i++)
-			central_values.push_back(point.getValue(i));
-
-		points.push_back(point);
+		return center_blocks.nearest(point);
 	}
 
-	void addPoint(Point point)
+	// copies the current centroids into the blocks read by the distance kernel
+	void packCenters()
 	{
-		points.push_back(point);
-	}
+		for (int i = 0; i < K; i++)
+			center_blocks.setCenter(i, clusters[i].getCentralValues());
 
-	bool removePoint(int id_point)
-	{
-		int total_points = points.size();
+		if (use_gemm)
+		{
+			for (int i = 0; i < K; i++)
+				gemm.setCenter(i, clusters[i].getCentralValues());
+		}
 
-		for (int i = 0; i < total_points; i++)
+		if (options.hamerly)
 		{
-			if (points[i].getID() == id_point)
-			{
-				points.erase(points.begin() + i);
-				return true;
-			}
+			for (int i = 0; i < K; i++)
+				bounds.setCenter(i, clusters[i].getCentralValues());
+			bounds.finishCenters();
 		}
-		return false;
 	}
 
-	double getCentralValue(int index)
+	void updateCenters(PointMatrix &points)
 	{
-		return central_values[index];
-	}
+		sums.assign(K * total_values, 0.0);
+		counts.assign(K, 0);
 
-	void setCentralValue(int index, double value)
-	{
-		central_values[index] = value;
+		accumulate(points.data(), points.getClusters(), 0, total_points, total_values, sums.data(), counts.data());
+
+		setCentersFromSums();
 	}
 
-	Point getPoint(int index)
+	// moves a point between the running sums of two clusters, used by the
+	// incremental update for the points that changed cluster
+	void movePoint(const double *values, int id_old_cluster, int id_new_cluster)
 	{
-		return points[index];
+		double *old_sum = &sums[id_old_cluster * total_values];
+		double *new_sum = &sums[id_new_cluster * total_values];
+
+		for (int j = 0; j < total_values; j++)
+		{
+			old_sum[j] -= values[j];
+			new_sum[j] += values[j];
+		}
+		counts[id_old_cluster]--;
+		counts[id_new_cluster]++;
 	}
 
-	int getTotalPoints()
+	void setCentersFromSums()
 	{
-		return points.size();
+		for (int i = 0; i < K; i++)
+		{
+			if (counts[i] > 0)
+			{
+				for (int j = 0; j < total_values; j++)
+					clusters[i].setCentralValue(j, sums[i * total_values + j] / counts[i]);
+			}
+		}
+
+		packCenters();
 	}
 
-	int getID()
+	// mini-batch mode (--minibatch): replaces the Lloyd iterations by sampled
+	// steps, optionally followed by one full assignment pass (--final-pass)
+	void runMiniBatch(PointMatrix &points)
 	{
-		return id_cluster;
-	}
-};
+		MiniBatch minibatch(K, total_values, parseSimdLevel(options.simd));
 
-class KMeans
-{
-private:
-	int K; // number of clusters
-	int total_values, total_points, max_iterations;
-	vector<Cluster> clusters;
+		for (int i = 0; i < K; i++)
+			minibatch.setCenter(i, clusters[i].getCentralValues());
 
-	// return ID of nearest center (uses euclidean distance)
-	int getIDNearestCenter(Point point)
-	{
-		double sum = 0.0, min_dist;
-		int id_cluster_center = 0;
+		minibatch.run(points, 0, total_points, options.minibatch_size, options.minibatch_iterations, rng());
 
-		for (int i = 0; i < total_values; i++)
+		for (int i = 0; i < K; i++)
 		{
-			sum += pow(clusters[0].getCentralValue(i) -
-						   point.getValue(i),
-					   2.0);
+			for (int j = 0; j < total_values; j++)
+				clusters[i].setCentralValue(j, minibatch.getCenter(i)[j]);
 		}
 
-		min_dist = sqrt(sum);
+		packCenters();
 
-		for (int i = 1; i < K; i++)
+		if (options.final_pass)
 		{
-			double dist;
-			sum = 0.0;
-
-			for (int j = 0; j < total_values; j++)
+			for (int i = 0; i < total_points; i++)
 			{
-				sum += pow(clusters[i].getCentralValue(j) -
-							   point.getValue(j),
-						   2.0);
-			}
+				int id_old_cluster = points.getCluster(i);
+				int id_nearest_center = getIDNearestCenter(points.getRow(i));
 
-			dist = sqrt(sum);
+				if (id_old_cluster != id_nearest_center)
+				{
+					if (id_old_cluster != -1)
+						clusters[id_old_cluster].removePoint(i, positions);
 
-			if (dist < min_dist)
-			{
-				min_dist = dist;
-				id_cluster_center = i;
+					points.setCluster(i, id_nearest_center);
+					clusters[id_nearest_center].addPoint(i, positions);
+				}
 			}
 		}
 
-		return id_cluster_center;
+		cout << "Mini-batch: " << options.minibatch_iterations << " iterations of " << options.minibatch_size << " points\n\n";
+	}
+
+	// one record of the trace: the phase times, the points that changed, the
+	// inertia of the assignment and how far the centers moved in the update
+	void traceIteration(int iter, double assign_time, double update_time, long long changed, double inertia,
+						double max_shift)
+	{
+		IterationRecord record;
+
+		record.iteration = iter;
+		record.assign_ns = toNanoseconds(assign_time);
+		record.update_ns = toNanoseconds(update_time);
+		record.changed = changed;
+		record.inertia = inertia;
+		record.max_shift = max_shift;
+		trace.addIteration(record);
 	}
 
 public:
-	KMeans(int K, int total_points, int total_values, int max_iterations)
+	KMeans(int K, int total_points, int total_values, int max_iterations, const Options &options = Options())
 	{
 		this->K = K;
 		this->total_points = total_points;
 		this->total_values = total_values;
 		this->max_iterations = max_iterations;
+		this->options = options;
+		use_gemm = false;
+		final_inertia = 0.0;
+		rng.seed(options.seed);
+	}
+
+	// starts the run from these centroids (K * total_values, row-major)
+	void setInitialCenters(const vector<double> &centers)
+	{
+		initial_centers = centers;
+	}
+
+	// final centroids of the run, for --save-model
+	KMeansModel getModel()
+	{
+		KMeansModel model;
+
+		model.K = clusters.size();
+		model.total_values = total_values;
+		model.iterations = times.iterations;
+		model.total_points = total_points;
+		model.inertia = final_inertia;
+
+		for (int i = 0; i < (int)clusters.size(); i++)
+			model.centers.insert(model.centers.end(), clusters[i].getCentralValues(),
+								 clusters[i].getCentralValues() + total_values);
+
+		return model;
+	}
+
+	PhaseTimes &getPhaseTimes()
+	{
+		return times;
 	}
 
-	void run(vector<Point> &points)
+	void run(PointMatrix &points)
 	{
 		if (K > total_points)
 			return;
 
-		vector<int> prohibited_indexes;
+		PhaseClock clock;
 
-		// choose K distinct values for the centers of the clusters
-		for (int i = 0; i < K; i++)
+		positions.assign(total_points, -1);
+		center_blocks = CenterBlocks(K, total_values, parseSimdLevel(options.simd));
+		accumulate = selectAccumulateKernel(total_values);
+
+		// the GEMM engine replaces the direct kernels, not the Hamerly bounds
+		use_gemm = !options.hamerly && useGemmAssignment(options.assign, K, total_values, options.gemm_threshold);
+		if (use_gemm)
+		{
+			gemm = GemmAssigner(K, total_values, parseSimdLevel(options.simd));
+			nearest_labels.resize(total_points);
+		}
+		if (options.hamerly)
+			bounds = HamerlyBounds(total_points, K, total_values);
+
+		// with --warm-start the centers are the saved ones, otherwise choose
+		// K distinct points, with k-means++ by default or uniformly with
+		// --init random
+		if (!initial_centers.empty())
 		{
-			while (true)
+			for (int i = 0; i < K; i++)
+				clusters.push_back(Cluster(i, &initial_centers[(size_t)i * total_values], total_values));
+		}
+		else
+		{
+			vector<int> seeds = options.init == "random" ? chooseRandomSeeds(total_points, K, rng)
+			                                             : chooseKMeansPlusPlusSeeds(points, K, rng);
+
+			for (int i = 0; i < K; i++)
 			{
-				int index_point = rand() % total_points;
+				int index_point = seeds[i];
 
-				if (find(prohibited_indexes.begin(), prohibited_indexes.end(),
-						 index_point) == prohibited_indexes.end())
-				{
-					prohibited_indexes.push_back(index_point);
-					points[index_point].setCluster(i);
-					Cluster cluster(i, points[index_point]);
-					clusters.push_back(cluster);
-					break;
-				}
+				points.setCluster(index_point, i);
+				Cluster cluster(i, points.getRow(index_point), total_values);
+				cluster.addPoint(index_point, positions);
+				clusters.push_back(cluster);
 			}
 		}
 
+		packCenters();
+		times.seed = clock.lap();
+
+		if (options.minibatch_size > 0)
+		{
+			runMiniBatch(points);
+			times.assign = clock.lap();
+			times.iterations = options.minibatch_iterations;
+			return;
+		}
+
+		trace.start(options.trace, true, "serial", total_points, total_values, K, 1, 1);
+		convergence = ConvergenceCheck(options, total_points, K, total_values, trace.enabled());
+		for (int i = 0; i < K && convergence.needsShift(); i++)
+			convergence.setCenter(i, clusters[i].getCentralValues());
+
 		int iter = 1;
 
 		while (true)
 		{
-			bool done = true;
+			long long changed = 0;
+			double inertia = 0.0; // only measured when convergence needs it
+
+			// in incremental mode the running sums are only patched with the points
+			// that changed cluster; the first iteration and every
+			// full_recompute_interval-th one rebuild them to bound the rounding drift
+			bool incremental_step = options.incremental && iter > 1 &&
+									(iter - 1) % options.full_recompute_interval != 0;
+
+			// with the GEMM engine the nearest centers are computed tile by tile first
+			if (use_gemm)
+			{
+				for (int tile = 0; tile < total_points; tile += GemmAssigner::tile_points)
+					gemm.assignTile(points.getRow(tile), min(GemmAssigner::tile_points, total_points - tile),
+									&nearest_labels[tile]);
+			}
 
 			// associates each point to the nearest center
 			for (int i = 0; i < total_points; i++)
 			{
-				int id_old_cluster = points[i].getCluster();
-				int id_nearest_center = getIDNearestCenter(points[i]);
+				int id_old_cluster = points.getCluster(i);
+				double distance = 0.0;
+				int id_nearest_center = use_gemm		 ? nearest_labels[i]
+										: options.hamerly ? bounds.assign(i, points.getRow(i), id_old_cluster)
+														  : center_blocks.nearest(points.getRow(i), &distance);
+
+				// the direct kernel already returns the squared distance
+				if (convergence.needsInertia())
+					inertia += use_gemm || options.hamerly
+								   ? squaredDistance(points.getRow(i), clusters[id_nearest_center].getCentralValues(), total_values)
+								   : distance;
 
 				if (id_old_cluster != id_nearest_center)
 				{
 					if (id_old_cluster != -1)
-						clusters[id_old_cluster].removePoint(points[i].getID());
+					{
+						clusters[id_old_cluster].removePoint(i, positions);
 
-					points[i].setCluster(id_nearest_center);
-					clusters[id_nearest_center].addPoint(points[i]);
-					done = false;
+						if (incremental_step)
+							movePoint(points.getRow(i), id_old_cluster, id_nearest_center);
+					}
+
+					points.setCluster(i, id_nearest_center);
+					clusters[id_nearest_center].addPoint(i, positions);
+					changed++;
 				}
 			}
 
-			// recalculating the center of each cluster
-			for (int i = 0; i < K; i++)
-			{
-				for (int j = 0; j < total_values; j++)
-				{
-					int total_points_cluster = clusters[i].getTotalPoints();
-					double sum = 0.0;
+			double assign_time = clock.lap();
+			times.assign += assign_time;
 
-					if (total_points_cluster > 0)
-					{
-						for (int p = 0; p < total_points_cluster; p++)
-							sum += clusters[i].getPoint(p).getValue(j);
-						clusters[i].setCentralValue(j, sum / total_points_cluster);
-					}
-				}
-			}
+			// recalculating the center of each cluster: one pass over the labels
+			// accumulates the sum and the count of every cluster
+			if (incremental_step)
+				setCentersFromSums();
+			else
+				updateCenters(points);
+
+			double update_time = clock.lap();
+			times.update += update_time;
+
+			double max_shift = 0.0;
+			for (int i = 0; i < K && convergence.needsShift(); i++)
+				max_shift = max(max_shift, convergence.centerShift(i, clusters[i].getCentralValues()));
 
-			if (done == true || iter >= max_iterations)
+			if (trace.enabled())
+				traceIteration(iter, assign_time, update_time, changed, inertia, max_shift);
+
+			// no point changed or one of the --tol-* criteria is met
+			bool converged = convergence.converged(changed, inertia, max_shift);
+
+			if (converged || iter >= max_iterations)
 			{
+				times.iterations = iter;
+				final_inertia = inertia;
+				if (converged && convergence.hasTolerance())
+					cout << "Converged: " << convergence.getReason() << "\n";
 				cout << "Break in iteration " << iter << "\n\n";
 				break;
 			}
 
 			iter++;
 		}
+
+		trace.write();
 		/* Comentei essa parte, pois o tempo que estava demorando para printar todos os pontos é um procedimento muito custoso
 				// shows elements of clusters
 				for (int i = 0; i < K; i++)
@@ -274,11 +446,13 @@ public:
 					cout << "Cluster " << clusters[i].getID() + 1 << endl;
 					for (int j = 0; j < total_points_cluster; j++)
 					{
-						cout << "Point " << clusters[i].getPoint(j).getID() + 1 << ": ";
+						int id_point = clusters[i].getPoint(j);
+
+						cout << "Point " << points.getID(id_point) + 1 << ": ";
 						for (int p = 0; p < total_values; p++)
-							cout << clusters[i].getPoint(j).getValue(p) << " ";
+							cout << points.getValue(id_point, p) << " ";
 
-						string point_name = clusters[i].getPoint(j).getName();
+						string point_name = points.getName(id_point);
 
 						if (point_name != "")
 							cout << "- " << point_name;
@@ -299,46 +473,45 @@ public:
 
 int main(int argc, char *argv[])
 {
-	srand(time(NULL));
-	auto start = std::chrono::high_resolution_clock::now();
+	Options options = parseOptions(argc, argv);
 
-	int total_points, total_values, K, max_iterations, has_name;
+	if (options.seed < 0)
+		options.seed = time(NULL);
 
-	cin >> total_points >> total_values >> K >> max_iterations >> has_name;
-
-	vector<Point> points;
-	string point_name;
-
-	for (int i = 0; i < total_points; i++)
-	{
-		vector<double> values;
-
-		for (int j = 0; j < total_values; j++)
-		{
-			double value;
-			cin >> value;
-			values.push_back(value);
-		}
-
-		if (has_name)
-		{
-			cin >> point_name;
-			Point p(i, values, point_name);
-			points.push_back(p);
-		}
-		else
-		{
-			Point p(i, values);
-			points.push_back(p);
-		}
-	}
+	auto start = std::chrono::high_resolution_clock::now();
 
-	KMeans kmeans(K, total_points, total_values, max_iterations);
+	// text from stdin, or the --input file (a binary dataset is memory mapped)
+	int K, max_iterations;
+	PhaseClock load_clock;
+	PointMatrix points = options.input.empty() ? readTextDataset(stdin, K, max_iterations)
+	                                           : loadDataset(options.input, K, max_iterations);
+	int total_points = points.getTotalPoints(), total_values = points.getTotalValues();
+	double load_time = load_clock.lap();
+
+	KMeansModel warm_start;
+	if (!options.warm_start.empty() && !loadWarmStart(options.warm_start, K, total_values, warm_start))
+		return 1;
+
+	KMeans kmeans(K, total_points, total_values, max_iterations, options);
+	if (!warm_start.centers.empty())
+		kmeans.setInitialCenters(warm_start.centers);
 	kmeans.run(points);
 
 	auto finish = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> elapsed = finish - start;
 	std::cout << "Tempo de execução: " << elapsed.count() << " segundos\n";
 
+	if (options.phase_times)
+	{
+		PhaseTimes &times = kmeans.getPhaseTimes();
+
+		times.load = load_time;
+		times.total = elapsed.count();
+		printPhaseTimes(std::cout, times);
+	}
+
+	if (!options.save_model.empty() && !saveModel(options.save_model, kmeans.getModel()))
+		return 1;
+
 	return 0;
 }
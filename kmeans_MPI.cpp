@@ -8,462 +8,829 @@
 #include <ctime>
 #include <algorithm>
 #include <chrono>
+#include <cstring>
 #include <omp.h>
 #include <mpi.h>
 
+#include "convergence.h"
+#include "dataset_file.h"
+#include "distance.h"
+#include "hamerly.h"
+#include "instrumentation.h"
+#include "kmeans_model.h"
+#include "lloyd_step.h"
+#include "options.h"
+#include "partial_sums.h"
+#include "phase_times.h"
+#include "point_matrix.h"
+#include "seeding.h"
+
 using namespace std;
 
-class Point
+class Cluster
 {
 private:
-    int id_point, id_cluster;
-    vector<double> values;
-    int total_values;
-    string name;
+    int id_cluster;
+    vector<double> central_values;
+    int total_points; // number of member points, updated by the centroid step
 
 public:
-    Point(int id_point, vector<double> &values, string name = "")
+    Cluster(int id_cluster, const double *values, int total_values)
     {
-        this->id_point = id_point;
-        total_values = values.size();
+        this->id_cluster = id_cluster;
+        total_points = 0;
 
         for (int i = 0; i < total_values; i++)
-            this->values.push_back(values[i]);
-
-        this->name = name;
-        id_cluster = -1;
+            central_values.push_back(values[i]);
     }
 
-    int getID()
+    double getCentralValue(int index)
     {
-        return id_point;
+        return central_values[index];
     }
 
-    void setCluster(int id_cluster)
+    void setCentralValue(int index, double value)
     {
-        this->id_cluster = id_cluster;
+        central_values[index] = value;
     }
 
-    int getCluster()
+    const double *getCentralValues()
     {
-        return id_cluster;
+        return central_values.data();
     }
 
-    double getValue(int index)
+    int getTotalPoints()
     {
-        return values[index];
+        return total_points;
     }
 
-    int getTotalValues()
+    void setTotalPoints(int total_points)
     {
-        return total_values;
+        this->total_points = total_points;
     }
 
-    void addValue(double value)
+    int getID()
     {
-        values.push_back(value);
+        return id_cluster;
     }
+};
+
+// contiguous block of points of a rank: the first (total_points % size)
+// ranks get one extra point
+void partitionRange(int total_points, int rank, int size, int &start_index, int &end_index)
+{
+    int points_per_proc = total_points / size;
+    int remainder = total_points % size;
 
-    string getName()
+    if (rank < remainder)
     {
-        return name;
+        start_index = rank * (points_per_proc + 1);
+        end_index = start_index + points_per_proc + 1;
     }
-};
+    else
+    {
+        start_index = rank * points_per_proc + remainder;
+        end_index = start_index + points_per_proc;
+    }
+}
 
-class Cluster
+class KMeans
 {
 private:
-    int id_cluster;
-    vector<double> central_values;
-    vector<Point> points;
-
-public:
-    Cluster(int id_cluster, Point point)
+    int K; // number of clusters
+    int total_values, total_points, max_iterations;
+    Options options;
+    mt19937_64 rng; // seeded with options.seed + rank in run()
+    vector<Cluster> clusters;
+    LloydStep step;              // fused assignment and accumulation, per-thread sums (lloyd_step.h)
+    HamerlyBounds bounds;        // used with --hamerly
+    PhaseTimes times;            // --phase-times, reported by rank 0
+    IterationTrace trace;        // --trace, written by rank 0
+    ConvergenceCheck convergence; // --tol-shift, --tol-inertia, --tol-changed (convergence.h)
+    double local_inertia;        // of the last assignment, only computed when needed
+    int active_threads;          // threads of the last assignment, whose partial sums hold its points
+    double final_inertia;        // global inertia of the last assignment, 0 when not measured
+    vector<double> initial_centers; // --warm-start, replaces the seeding when set
+
+    // the whole per-iteration reduction goes in one buffer: for every cluster
+    // its D sums followed by its count, then the number of points that
+    // changed cluster (counts fit exactly in a double) and the inertia (0
+    // unless a criterion or the trace needs it); sized once in run()
+    vector<double> local_reduce, global_reduce;
+    vector<MPI_Request> requests; // one per block with --overlap
+
+    // return ID of nearest center (compares squared euclidean distances with
+    // the SIMD kernel selected at runtime, see distance.h)
+    int getIDNearestCenter(const double *point)
     {
-        this->id_cluster = id_cluster;
-
-        int total_values = point.getTotalValues();
-
-        for (int i = 0; i < total_values; i++)
-            central_values.push_back(point.getValue(i));
-
-        points.push_back(point);
+        return step.nearest(point);
     }
 
-    void addPoint(Point point)
+    // copies the current centroids into the blocks read by the distance kernel
+    void packCenters()
     {
-        points.push_back(point);
+        for (int i = 0; i < K; i++)
+            step.setCenter(i, clusters[i].getCentralValues());
+
+        if (options.hamerly)
+        {
+            for (int i = 0; i < K; i++)
+                bounds.setCenter(i, clusters[i].getCentralValues());
+            bounds.finishCenters();
+        }
     }
 
-    bool removePoint(int id_point)
+    // assigns every local point to the nearest center; the threads also add
+    // each tile of their points to private sums right after labelling it.
+    // With reduce_threads the sums are combined with a tree reduction (result
+    // in partial sums slot 0); --overlap leaves them per thread and combines
+    // them block by block in reduceOverlapped. Returns the number of changed
+    // points.
+    long long assignAndAccumulate(PointMatrix &points, bool reduce_threads)
     {
-        int total_points = points.size();
+        int local_total_points = points.getTotalPoints();
+        long long changed = 0;
+        double inertia = 0.0;
 
-        for (int i = 0; i < total_points; i++)
+#pragma omp parallel reduction(+ : changed, inertia)
         {
-            if (points[i].getID() == id_point)
+            int thread = omp_get_thread_num(), total_threads = omp_get_num_threads();
+            int begin = (long long)local_total_points * thread / total_threads;
+            int end = (long long)local_total_points * (thread + 1) / total_threads;
+
+            step.clear(thread);
+
+            if (thread == 0)
+                active_threads = total_threads;
+
+            if (!options.hamerly)
+                changed += step.assignAndAccumulate(points.data(), points.getClusters(), begin, end, thread,
+                                                    convergence.needsInertia(), inertia);
+            else
             {
-                points.erase(points.begin() + i);
-                return true;
+                // the bounds label the points one by one
+                for (int tile = begin; tile < end; tile += LloydStep::tile_size)
+                {
+                    int tile_end = min(tile + LloydStep::tile_size, end);
+
+                    for (int i = tile; i < tile_end; i++)
+                    {
+                        int id_old_cluster = points.getCluster(i);
+                        int id_nearest_center = bounds.assign(i, points.getRow(i), id_old_cluster);
+
+                        points.setCluster(i, id_nearest_center);
+
+                        if (id_old_cluster != id_nearest_center)
+                            changed++;
+
+                        if (convergence.needsInertia())
+                            inertia += squaredDistance(points.getRow(i), clusters[id_nearest_center].getCentralValues(), total_values);
+                    }
+
+                    step.accumulateTile(points.data(), points.getClusters(), tile, tile_end, thread);
+                }
             }
+
+            if (reduce_threads)
+                step.reduce(thread, total_threads);
         }
-        return false;
-    }
 
-    double getCentralValue(int index)
-    {
-        return central_values[index];
+        local_inertia = inertia;
+        return changed;
     }
 
-    void setCentralValue(int index, double value)
+    // --overlap: the per-thread sums of assignAndAccumulate are combined
+    // into local_reduce one block of clusters at a time, and the reduction of
+    // every block is started with MPI_Iallreduce while the next block is
+    // combined. No pass over the points: the accumulation already happened
+    // in the assignment.
+    void reduceOverlapped(long long changed)
     {
-        central_values[index] = value;
-    }
+        int stride = total_values + 1;
+        int total_blocks = requests.size();
 
-    Point getPoint(int index)
-    {
-        return points[index];
-    }
+        local_reduce[(size_t)K * stride] = changed;
+        local_reduce[(size_t)K * stride + 1] = local_inertia;
 
-    int getTotalPoints()
-    {
-        return points.size();
-    }
+        for (int b = 0; b < total_blocks; b++)
+        {
+            int first_cluster = (long long)K * b / total_blocks, last_cluster = (long long)K * (b + 1) / total_blocks;
 
-    int getID()
-    {
-        return id_cluster;
-    }
+#pragma omp parallel for schedule(static)
+            for (int c = first_cluster; c < last_cluster; c++)
+            {
+                double *row = &local_reduce[(size_t)c * stride];
+                long long count = 0;
 
-    void clearPoints()
-    {
-        points.clear();
-    }
-};
+                for (int j = 0; j < total_values; j++)
+                    row[j] = 0.0;
 
-class KMeans
-{
-private:
-    int K; // number of clusters
-    int total_values, total_points, max_iterations;
-    vector<Cluster> clusters;
+                for (int t = 0; t < active_threads; t++)
+                {
+                    const double *sums = step.getPartialSums().getSums(t) + (size_t)c * total_values;
 
-    // return ID of nearest center (uses Euclidean distance)
-    int getIDNearestCenter(Point &point)
-    {
-        double min_dist = numeric_limits<double>::max();
-        int id_cluster_center = -1;
+                    for (int j = 0; j < total_values; j++)
+                        row[j] += sums[j];
+                    count += step.getPartialSums().getCounts(t)[c];
+                }
 
-        for (int i = 0; i < K; i++)
-        {
-            double sum = 0.0;
-            for (int j = 0; j < total_values; j++)
-            {
-                sum += pow(clusters[i].getCentralValue(j) - point.getValue(j), 2.0);
+                row[total_values] = count;
             }
-            double dist = sqrt(sum);
 
-            if (dist < min_dist)
-            {
-                min_dist = dist;
-                id_cluster_center = i;
-            }
+            // the changed count and the inertia travel with the last block
+            size_t begin = (size_t)first_cluster * stride;
+            size_t end = (size_t)last_cluster * stride + (b == total_blocks - 1 ? 2 : 0);
+
+            MPI_Iallreduce(&local_reduce[begin], &global_reduce[begin], end - begin, MPI_DOUBLE, MPI_SUM,
+                           MPI_COMM_WORLD, &requests[b]);
+
+            // lets the library progress the reductions already started
+            int flag;
+            MPI_Testall(b + 1, requests.data(), &flag, MPI_STATUSES_IGNORE);
         }
 
-        return id_cluster_center;
+        MPI_Waitall(total_blocks, requests.data(), MPI_STATUSES_IGNORE);
     }
 
-public:
-    KMeans(int K, int total_points, int total_values, int max_iterations)
+    // returns the local indexes of the points of a cluster in this rank's
+    // slice, built on demand from the labels
+    vector<int> getClusterPoints(PointMatrix &points, int id_cluster)
     {
-        this->K = K;
-        this->total_points = total_points;
-        this->total_values = total_values;
-        this->max_iterations = max_iterations;
+        vector<int> cluster_points;
+
+        for (int i = 0; i < points.getTotalPoints(); i++)
+        {
+            if (points.getCluster(i) == id_cluster)
+                cluster_points.push_back(i);
+        }
+
+        return cluster_points;
     }
 
-    void run(vector<Point> &all_points, int rank, int size)
+    // returns the coordinates of the given global point indexes on every
+    // rank: each owner writes its rows and the others contribute zeros
+    vector<double> gatherRows(PointMatrix &points, const vector<int> &indexes, int start_index, int end_index)
     {
-        if (K > total_points)
-            return;
-
-        int points_per_proc = total_points / size;
-        int remainder = total_points % size;
-        int start_index, end_index;
+        int total = indexes.size();
+        vector<double> local_rows((size_t)total * total_values, 0.0), rows((size_t)total * total_values);
 
-        if (rank < remainder)
+        for (int c = 0; c < total; c++)
         {
-            start_index = rank * (points_per_proc + 1);
-            end_index = start_index + points_per_proc + 1;
-        }
-        else
-        {
-            start_index = rank * points_per_proc + remainder;
-            end_index = start_index + points_per_proc;
+            if (indexes[c] >= start_index && indexes[c] < end_index)
+            {
+                const double *row = points.getRow(indexes[c] - start_index);
+
+                for (int j = 0; j < total_values; j++)
+                    local_rows[(size_t)c * total_values + j] = row[j];
+            }
         }
 
-        vector<Point> points(all_points.begin() + start_index, all_points.begin() + end_index);
-        int local_total_points = points.size();
+        MPI_Allreduce(local_rows.data(), rows.data(), total * total_values, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        return rows;
+    }
+
+    // k-means|| (Bahmani et al.): a few rounds where every rank samples its
+    // own points with probability proportional to the squared distance to the
+    // candidates, then rank 0 reduces the weighted candidates to K centers
+    // with k-means++. Only candidate indexes and rows are exchanged, never
+    // the local points.
+    vector<double> chooseParallelSeeds(PointMatrix &points, int start_index, int end_index, int rank, int size)
+    {
+        const int rounds = 5;
+        const double oversampling = 2.0 * K;
+        int local_total_points = end_index - start_index;
 
-        // Initialize clusters (only on rank 0)
+        // the first candidate is uniform over all the points
+        vector<int> candidate_indexes(1);
         if (rank == 0)
+            candidate_indexes[0] = uniform_int_distribution<int>(0, total_points - 1)(rng);
+        MPI_Bcast(candidate_indexes.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+        vector<double> candidates = gatherRows(points, candidate_indexes, start_index, end_index);
+        vector<double> min_distance(local_total_points, numeric_limits<double>::max());
+        int checked = 0; // candidates already folded into min_distance
+
+        for (int round = 0; round <= rounds; round++)
         {
-            vector<int> prohibited_indexes;
+            int total_candidates = candidate_indexes.size();
+            double local_phi = 0.0, phi;
 
-            // Choose K distinct values for the centers of the clusters
-            for (int i = 0; i < K; i++)
+#pragma omp parallel for schedule(static) reduction(+ : local_phi)
+            for (int i = 0; i < local_total_points; i++)
             {
-                while (true)
+                const double *row = points.getRow(i);
+
+                for (int c = checked; c < total_candidates; c++)
                 {
-                    int index_point = rand() % total_points;
+                    double d = squaredDistance(row, &candidates[(size_t)c * total_values], total_values);
 
-                    if (find(prohibited_indexes.begin(), prohibited_indexes.end(),
-                             index_point) == prohibited_indexes.end())
-                    {
-                        prohibited_indexes.push_back(index_point);
-                        all_points[index_point].setCluster(i);
-                        Cluster cluster(i, all_points[index_point]);
-                        clusters.push_back(cluster);
-                        break;
-                    }
+                    if (d < min_distance[i])
+                        min_distance[i] = d;
                 }
+                local_phi += min_distance[i];
             }
-        }
+            checked = total_candidates;
 
-        // Broadcast initial clusters to all processes
-        // Serialize cluster centers
-        vector<double> cluster_centers(K * total_values);
+            MPI_Allreduce(&local_phi, &phi, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
 
-        if (rank == 0)
-        {
-            for (int i = 0; i < K; i++)
+            // the last pass only updates the distances; with phi = 0 every
+            // point already coincides with a candidate
+            if (round == rounds || phi <= 0.0)
+                break;
+
+            vector<int> local_sampled;
+            uniform_real_distribution<double> coin(0.0, 1.0);
+
+            for (int i = 0; i < local_total_points; i++)
             {
-                for (int j = 0; j < total_values; j++)
-                {
-                    cluster_centers[i * total_values + j] = clusters[i].getCentralValue(j);
-                }
+                if (coin(rng) * phi < oversampling * min_distance[i])
+                    local_sampled.push_back(start_index + i);
             }
-        }
 
-        MPI_Bcast(cluster_centers.data(), K * total_values, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+            int local_count = local_sampled.size();
+            vector<int> counts(size), displs(size, 0);
 
-        // Reconstruct clusters on other processes
-        if (rank != 0)
+            MPI_Allgather(&local_count, 1, MPI_INT, counts.data(), 1, MPI_INT, MPI_COMM_WORLD);
+            for (int r = 1; r < size; r++)
+                displs[r] = displs[r - 1] + counts[r - 1];
+
+            vector<int> sampled(displs[size - 1] + counts[size - 1]);
+            MPI_Allgatherv(local_sampled.data(), local_count, MPI_INT, sampled.data(), counts.data(),
+                           displs.data(), MPI_INT, MPI_COMM_WORLD);
+
+            vector<double> rows = gatherRows(points, sampled, start_index, end_index);
+            candidate_indexes.insert(candidate_indexes.end(), sampled.begin(), sampled.end());
+            candidates.insert(candidates.end(), rows.begin(), rows.end());
+        }
+
+        // too few candidates (tiny or degenerate inputs): complete them with
+        // distinct random points
+        if ((int)candidate_indexes.size() < K)
         {
-            clusters.clear();
-            for (int i = 0; i < K; i++)
+            vector<int> extra;
+
+            if (rank == 0)
             {
-                vector<double> center_values(total_values);
-                for (int j = 0; j < total_values; j++)
+                unordered_set<int> taken(candidate_indexes.begin(), candidate_indexes.end());
+
+                for (int index_point : chooseRandomSeeds(total_points, K, rng))
                 {
-                    center_values[j] = cluster_centers[i * total_values + j];
+                    if ((int)(candidate_indexes.size() + extra.size()) < K && taken.insert(index_point).second)
+                        extra.push_back(index_point);
                 }
-                Point dummy_point(-1, center_values);
-                Cluster cluster(i, dummy_point);
-                cluster.clearPoints(); // Remove the dummy point
-                clusters.push_back(cluster);
             }
+
+            int total_extra = extra.size();
+            MPI_Bcast(&total_extra, 1, MPI_INT, 0, MPI_COMM_WORLD);
+            extra.resize(total_extra);
+            MPI_Bcast(extra.data(), total_extra, MPI_INT, 0, MPI_COMM_WORLD);
+
+            vector<double> rows = gatherRows(points, extra, start_index, end_index);
+            candidate_indexes.insert(candidate_indexes.end(), extra.begin(), extra.end());
+            candidates.insert(candidates.end(), rows.begin(), rows.end());
         }
 
-        int iter = 1;
-        while (true)
-        {
-            bool done = true;
+        // weight of a candidate: number of points closer to it than to any other
+        int total_candidates = candidate_indexes.size();
+        CenterBlocks candidate_blocks(total_candidates, total_values, parseSimdLevel(options.simd));
+        vector<int> nearest(local_total_points);
+        vector<double> local_weights(total_candidates, 0.0), weights(total_candidates);
 
-            vector<int> new_clusters(local_total_points);
+        for (int c = 0; c < total_candidates; c++)
+            candidate_blocks.setCenter(c, &candidates[(size_t)c * total_values]);
 
-            // Assign points to the nearest cluster
 #pragma omp parallel for schedule(static)
-            for (int i = 0; i < local_total_points; i++)
-            {
-                int id_old_cluster = points[i].getCluster();
-                int id_nearest_center = getIDNearestCenter(points[i]);
+        for (int i = 0; i < local_total_points; i++)
+            nearest[i] = candidate_blocks.nearest(points.getRow(i));
 
-                new_clusters[i] = id_nearest_center;
+        for (int i = 0; i < local_total_points; i++)
+            local_weights[nearest[i]] += 1.0;
 
-                if (id_old_cluster != id_nearest_center)
-                {
-#pragma omp atomic write
-                    done = false;
-                }
-            }
+        MPI_Reduce(local_weights.data(), weights.data(), total_candidates, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
 
-            // Gather the 'done' flag from all processes
-            int global_done;
-            MPI_Allreduce(&done, &global_done, 1, MPI_C_BOOL, MPI_LAND, MPI_COMM_WORLD);
-            done = global_done;
+        vector<double> cluster_centers((size_t)K * total_values);
+
+        if (rank == 0)
+        {
+            vector<int> chosen = weightedKMeansPlusPlus(candidates, weights, total_values, K, rng);
 
-            // Clear old points from clusters
             for (int i = 0; i < K; i++)
             {
-                clusters[i].clearPoints();
+                for (int j = 0; j < total_values; j++)
+                    cluster_centers[(size_t)i * total_values + j] = candidates[(size_t)chosen[i] * total_values + j];
             }
+        }
 
-            // Assign points to clusters
-            for (int i = 0; i < local_total_points; i++)
+        MPI_Bcast(cluster_centers.data(), K * total_values, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        return cluster_centers;
+    }
+
+    // one record of the trace, with the global changed count, inertia and
+    // shift and the local assignment time, which finishTrace combines
+    // between the ranks
+    void traceIteration(int iter, double assign_time, double communicate_time, double update_time, long long changed,
+                        double inertia, double max_shift)
+    {
+        IterationRecord record;
+
+        record.iteration = iter;
+        record.assign_ns = toNanoseconds(assign_time);
+        record.communicate_ns = toNanoseconds(communicate_time);
+        record.update_ns = toNanoseconds(update_time);
+        record.changed = changed;
+        record.inertia = inertia;
+        record.max_shift = max_shift;
+
+        trace.addIteration(record);
+    }
+
+    // after the last iteration: measures the imbalance of every assignment
+    // (max / mean - 1 of the rank times), then rank 0 writes the file
+    void finishTrace(int rank, int size)
+    {
+        vector<IterationRecord> &records = trace.getRecords();
+        int total_records = records.size();
+        vector<double> assign_time(total_records), max_time(total_records), sum_time(total_records);
+
+        for (int r = 0; r < total_records; r++)
+            assign_time[r] = records[r].assign_ns;
+
+        MPI_Reduce(assign_time.data(), max_time.data(), total_records, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+        MPI_Reduce(assign_time.data(), sum_time.data(), total_records, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+
+        if (rank == 0)
+        {
+            for (int r = 0; r < total_records; r++)
             {
-                points[i].setCluster(new_clusters[i]);
-                clusters[new_clusters[i]].addPoint(points[i]);
+                double mean_time = sum_time[r] / size;
+
+                records[r].imbalance = mean_time > 0.0 ? max_time[r] / mean_time - 1.0 : 0.0;
             }
+        }
 
-            // Recalculate the center of each cluster
-            vector<double> local_new_centers(K * total_values, 0.0);
-            vector<int> local_counts(K, 0);
+        trace.write();
+    }
 
-            for (int i = 0; i < K; i++)
+public:
+    KMeans(int K, int total_points, int total_values, int max_iterations, const Options &options = Options())
+    {
+        this->K = K;
+        this->total_points = total_points;
+        this->total_values = total_values;
+        this->max_iterations = max_iterations;
+        this->options = options;
+        local_inertia = 0.0;
+        final_inertia = 0.0;
+    }
+
+    // starts the run from these centroids (K * total_values, row-major, the
+    // same on every rank)
+    void setInitialCenters(const vector<double> &centers)
+    {
+        initial_centers = centers;
+    }
+
+    // final centroids of the run (the same on every rank), for --save-model
+    KMeansModel getModel()
+    {
+        KMeansModel model;
+
+        model.K = clusters.size();
+        model.total_values = total_values;
+        model.iterations = times.iterations;
+        model.total_points = total_points;
+        model.inertia = final_inertia;
+
+        for (int i = 0; i < (int)clusters.size(); i++)
+            model.centers.insert(model.centers.end(), clusters[i].getCentralValues(),
+                                 clusters[i].getCentralValues() + total_values);
+
+        return model;
+    }
+
+    PhaseTimes &getPhaseTimes()
+    {
+        return times;
+    }
+
+    void run(PointMatrix &points, int rank, int size)
+    {
+        if (K > total_points)
+            return;
+
+        PhaseClock clock;
+
+        // points holds only this rank's slice [start_index, end_index) of
+        // the dataset; local point i is the global point start_index + i
+        int start_index, end_index;
+        partitionRange(total_points, rank, size, start_index, end_index);
+
+        int local_total_points = end_index - start_index;
+
+        // every rank draws from its own stream; the collective choices
+        // (first candidate, final reduction) are made by rank 0
+        rng.seed(options.seed + rank);
+
+        // Choose the initial centers: the saved ones with --warm-start,
+        // k-means|| by default, or K distinct points chosen uniformly by
+        // rank 0 with --init random
+        vector<double> cluster_centers;
+
+        if (!initial_centers.empty())
+            cluster_centers = initial_centers;
+        else if (options.init == "random")
+        {
+            vector<int> seeds(K);
+
+            if (rank == 0)
+                seeds = chooseRandomSeeds(total_points, K, rng);
+            MPI_Bcast(seeds.data(), K, MPI_INT, 0, MPI_COMM_WORLD);
+
+            cluster_centers = gatherRows(points, seeds, start_index, end_index);
+        }
+        else
+            cluster_centers = chooseParallelSeeds(points, start_index, end_index, rank, size);
+
+        for (int i = 0; i < K; i++)
+        {
+            Cluster cluster(i, &cluster_centers[i * total_values], total_values);
+            clusters.push_back(cluster);
+        }
+
+        // the GEMM engine replaces the direct kernels, not the Hamerly bounds
+        step = LloydStep(K, total_values, options.hamerly ? "direct" : options.assign, options.gemm_threshold,
+                         parseSimdLevel(options.simd), omp_get_max_threads());
+        if (options.hamerly)
+            bounds = HamerlyBounds(local_total_points, K, total_values);
+        packCenters();
+
+        const int stride = total_values + 1;
+        local_reduce.assign((size_t)K * stride + 2, 0.0);
+        global_reduce.assign((size_t)K * stride + 2, 0.0);
+        requests.assign(options.overlap ? min(options.overlap_blocks, K) : 0, MPI_REQUEST_NULL);
+        trace.start(options.trace, rank == 0, "mpi", total_points, total_values, K, omp_get_max_threads(), size);
+        convergence = ConvergenceCheck(options, total_points, K, total_values, trace.enabled());
+        for (int i = 0; i < K && convergence.needsShift(); i++)
+            convergence.setCenter(i, clusters[i].getCentralValues());
+
+        times.seed = clock.lap();
+
+        int iter = 1;
+        while (true)
+        {
+            // Assign points to the nearest cluster and accumulate the local
+            // sums and counts in the same pass (threads), then reduce them,
+            // together with the changed count, in a single MPI_Allreduce
+            long long changed = assignAndAccumulate(points, !options.overlap);
+            double assign_time = clock.lap();
+            times.assign += assign_time;
+
+            // with --overlap the combination of the per-thread sums runs
+            // inside reduceOverlapped and is counted as communication
+            if (options.overlap)
+                reduceOverlapped(changed);
+            else
             {
-                int total_points_cluster = clusters[i].getTotalPoints();
+                const double *local_sums = step.getPartialSums().getSums(0);
+                const int *local_counts = step.getPartialSums().getCounts(0);
 
-                if (total_points_cluster > 0)
+                for (int i = 0; i < K; i++)
                 {
-                    local_counts[i] = total_points_cluster;
-
-                    for (int p = 0; p < total_points_cluster; p++)
-                    {
-                        for (int j = 0; j < total_values; j++)
-                        {
-                            local_new_centers[i * total_values + j] += clusters[i].getPoint(p).getValue(j);
-                        }
-                    }
+                    for (int j = 0; j < total_values; j++)
+                        local_reduce[(size_t)i * stride + j] = local_sums[(size_t)i * total_values + j];
+                    local_reduce[(size_t)i * stride + total_values] = local_counts[i];
                 }
+                local_reduce[(size_t)K * stride] = changed;
+                local_reduce[(size_t)K * stride + 1] = local_inertia;
+
+                MPI_Allreduce(local_reduce.data(), global_reduce.data(), K * stride + 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
             }
 
-            // Reduce to get the global sums and counts
-            vector<double> global_new_centers(K * total_values, 0.0);
-            vector<int> global_counts(K, 0);
+            double communicate_time = clock.lap();
+            times.communicate += communicate_time;
 
-            MPI_Allreduce(local_new_centers.data(), global_new_centers.data(), K * total_values, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
-            MPI_Allreduce(local_counts.data(), global_counts.data(), K, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+            long long global_changed = global_reduce[(size_t)K * stride];
+            double inertia = global_reduce[(size_t)K * stride + 1];
+            double max_shift = 0.0;
 
             // Update cluster centers
             for (int i = 0; i < K; i++)
             {
-                if (global_counts[i] > 0)
+                const double *row = &global_reduce[(size_t)i * stride];
+                int count = row[total_values];
+
+                clusters[i].setTotalPoints(count);
+
+                if (count > 0)
                 {
                     for (int j = 0; j < total_values; j++)
                     {
-                        clusters[i].setCentralValue(j, global_new_centers[i * total_values + j] / global_counts[i]);
+                        clusters[i].setCentralValue(j, row[j] / count);
                     }
                 }
+
+                // the global centers are the same on every rank, and so is the shift
+                if (convergence.needsShift())
+                    max_shift = max(max_shift, convergence.centerShift(i, clusters[i].getCentralValues()));
             }
 
-            if (done == true || iter >= max_iterations)
+            packCenters();
+            double update_time = clock.lap();
+            times.update += update_time;
+
+            if (trace.enabled())
+                traceIteration(iter, assign_time, communicate_time, update_time, global_changed, inertia, max_shift);
+
+            bool converged = convergence.converged(global_changed, inertia, max_shift);
+
+            if (converged || iter >= max_iterations)
             {
+                times.iterations = iter;
+                final_inertia = inertia;
                 if (rank == 0)
+                {
+                    if (converged && convergence.hasTolerance())
+                        cout << "Converged: " << convergence.getReason() << "\n";
                     cout << "Break in iteration " << iter << "\n\n";
+                }
                 break;
             }
 
             iter++;
         }
 
+        if (trace.enabled())
+            finishTrace(rank, size);
+
         // Optionally, gather results on rank 0 for final output
         // (This code is omitted for brevity)
     }
 };
 
-int main(int argc, char *argv[])
+// every rank opens the file and reads the header and its own block of rows
+// with one collective MPI-IO call; names are not loaded (the MPI version
+// never prints them)
+PointMatrix readBinaryPartition(const string &path, int rank, int size, int &total_points, int &total_values,
+                                int &K, int &max_iterations)
 {
-    MPI_Init(&argc, &argv);
-
-    int rank, size;
-    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-    MPI_Comm_size(MPI_COMM_WORLD, &size);
-
-    srand(time(NULL) + rank); // Different seed for each process
+    MPI_File file;
+    DatasetHeader header;
 
-    // Start timing
-    auto start = std::chrono::high_resolution_clock::now();
+    if (MPI_File_open(MPI_COMM_WORLD, path.c_str(), MPI_MODE_RDONLY, MPI_INFO_NULL, &file) != MPI_SUCCESS)
+    {
+        cerr << path << ": cannot open the dataset file\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
 
-    // Default number of threads
-    int num_threads = 1;
+    MPI_File_read_at_all(file, 0, &header, sizeof(header), MPI_BYTE, MPI_STATUS_IGNORE);
 
-    if (argc > 1)
+    if (memcmp(header.magic, DATASET_MAGIC, 8) != 0 || header.version != DATASET_VERSION)
     {
-        num_threads = atoi(argv[1]);
+        cerr << path << ": not a binary dataset (see convertDataset)\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
-    // Set the number of threads for parallelization
-    omp_set_num_threads(num_threads);
+    // every rank reads the same header, so all of them stop here together
+    MPI_Offset file_size;
+    MPI_File_get_size(file, &file_size);
+    checkDatasetHeader(path, header, (uint64_t)file_size);
 
-    int total_points, total_values, K, max_iterations, has_name;
+    total_points = header.total_points;
+    total_values = header.total_values;
+    K = header.K;
+    max_iterations = header.max_iterations;
 
-    vector<Point> all_points;
+    int start_index, end_index;
+    partitionRange(total_points, rank, size, start_index, end_index);
 
-    if (rank == 0)
-    {
-        cin >> total_points >> total_values >> K >> max_iterations >> has_name;
+    int local_total_points = end_index - start_index;
+    PointMatrix points(local_total_points, total_values);
+    bool is_float = header.value_type == DATASET_FLOAT32;
+    MPI_Datatype row_type;
 
-        string point_name;
+    // one row per element keeps the counts small for large slices
+    MPI_Type_contiguous(total_values, is_float ? MPI_FLOAT : MPI_DOUBLE, &row_type);
+    MPI_Type_commit(&row_type);
 
-        for (int i = 0; i < total_points; i++)
-        {
-            vector<double> values;
+    MPI_Offset offset = header.values_offset + (MPI_Offset)start_index * total_values * (is_float ? sizeof(float) : sizeof(double));
 
-            for (int j = 0; j < total_values; j++)
-            {
-                double value;
-                cin >> value;
-                values.push_back(value);
-            }
+    if (is_float)
+    {
+        vector<float> narrow((size_t)local_total_points * total_values);
+        MPI_File_read_at_all(file, offset, narrow.data(), local_total_points, row_type, MPI_STATUS_IGNORE);
 
-            if (has_name)
-            {
-                cin >> point_name;
-                Point p(i, values, point_name);
-                all_points.push_back(p);
-            }
-            else
-            {
-                Point p(i, values);
-                all_points.push_back(p);
-            }
-        }
+        for (size_t v = 0; v < narrow.size(); v++)
+            points.data()[v] = narrow[v];
     }
+    else
+        MPI_File_read_at_all(file, offset, points.data(), local_total_points, row_type, MPI_STATUS_IGNORE);
 
-    // Broadcast parameters to all processes
-    MPI_Bcast(&total_points, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&total_values, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&K, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&max_iterations, 1, MPI_INT, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&has_name, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Type_free(&row_type);
+    MPI_File_close(&file);
 
-    // Broadcast points to all processes
-    // Serialize points
-    int point_data_size = total_points * total_values;
-    vector<double> point_data(point_data_size);
+    for (int i = 0; i < local_total_points; i++)
+        points.setID(i, start_index + i);
+
+    return points;
+}
+
+// rank 0 parses the text (stdin or path) and sends each rank its block of
+// rows with MPI_Scatterv; afterwards rank 0 also keeps only its own block
+PointMatrix scatterTextDataset(const string &path, int rank, int size, int &total_points, int &total_values,
+                               int &K, int &max_iterations)
+{
+    PointMatrix all_points;
 
     if (rank == 0)
     {
-        for (int i = 0; i < total_points; i++)
-        {
-            for (int j = 0; j < total_values; j++)
-            {
-                point_data[i * total_values + j] = all_points[i].getValue(j);
-            }
-        }
+        all_points = path.empty() ? readTextDataset(stdin, K, max_iterations) : loadDataset(path, K, max_iterations);
+        total_points = all_points.getTotalPoints();
+        total_values = all_points.getTotalValues();
     }
 
-    MPI_Bcast(point_data.data(), point_data_size, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+    int parameters[4] = {total_points, total_values, K, max_iterations};
+    MPI_Bcast(parameters, 4, MPI_INT, 0, MPI_COMM_WORLD);
+    total_points = parameters[0];
+    total_values = parameters[1];
+    K = parameters[2];
+    max_iterations = parameters[3];
 
-    // Reconstruct all_points on other processes
-    if (rank != 0)
+    vector<int> counts(size), displs(size);
+
+    for (int r = 0; r < size; r++)
     {
-        all_points.clear();
-        for (int i = 0; i < total_points; i++)
-        {
-            vector<double> values(total_values);
-            for (int j = 0; j < total_values; j++)
-            {
-                values[j] = point_data[i * total_values + j];
-            }
-            Point p(i, values);
-            all_points.push_back(p);
-        }
+        int start_index, end_index;
+        partitionRange(total_points, r, size, start_index, end_index);
+        counts[r] = end_index - start_index;
+        displs[r] = start_index;
     }
 
-    KMeans kmeans(K, total_points, total_values, max_iterations);
-    kmeans.run(all_points, rank, size);
+    PointMatrix points(counts[rank], total_values);
+    MPI_Datatype row_type;
+
+    MPI_Type_contiguous(total_values, MPI_DOUBLE, &row_type);
+    MPI_Type_commit(&row_type);
+    MPI_Scatterv(all_points.data(), counts.data(), displs.data(), row_type, points.data(), counts[rank], row_type, 0,
+                 MPI_COMM_WORLD);
+    MPI_Type_free(&row_type);
+
+    for (int i = 0; i < counts[rank]; i++)
+        points.setID(i, displs[rank] + i);
+
+    return points;
+}
+
+int main(int argc, char *argv[])
+{
+    MPI_Init(&argc, &argv);
+
+    int rank, size;
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    // Start timing
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Number of threads (default 1) and optional features
+    Options options = parseOptions(argc, argv);
+    int num_threads = options.num_threads;
+
+    // rank 0's seed is shared, each rank then offsets it by its rank
+    if (options.seed < 0)
+        options.seed = time(NULL);
+    MPI_Bcast(&options.seed, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+
+    // Set the number of threads for parallelization
+    omp_set_num_threads(num_threads);
+
+    // Every rank keeps only its own slice of the points: a binary dataset
+    // is read in parallel with MPI-IO, text is parsed by rank 0 and
+    // scattered
+    int total_points, total_values, K, max_iterations;
+    PhaseClock load_clock;
+
+    PointMatrix points = !options.input.empty() && isBinaryDataset(options.input)
+                             ? readBinaryPartition(options.input, rank, size, total_points, total_values, K, max_iterations)
+                             : scatterTextDataset(options.input, rank, size, total_points, total_values, K, max_iterations);
+
+    double load_time = load_clock.lap();
+
+    KMeans kmeans(K, total_points, total_values, max_iterations, options);
+
+    // --warm-start: rank 0 reads the model and sends the centroids to the others
+    if (!options.warm_start.empty())
+    {
+        KMeansModel warm_start;
+
+        if (rank == 0 && !loadWarmStart(options.warm_start, K, total_values, warm_start))
+            MPI_Abort(MPI_COMM_WORLD, 1);
+
+        warm_start.centers.resize((size_t)K * total_values);
+        MPI_Bcast(warm_start.centers.data(), K * total_values, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+        kmeans.setInitialCenters(warm_start.centers);
+    }
+
+    kmeans.run(points, rank, size);
 
     // Stop timing
     auto finish = std::chrono::high_resolution_clock::now();
@@ -473,6 +840,18 @@ int main(int argc, char *argv[])
     if (rank == 0)
     {
         std::cout << "Execution time with " << size << " process(es) and " << num_threads << " thread(s): " << elapsed.count() << " seconds\n";
+
+        if (options.phase_times)
+        {
+            PhaseTimes &times = kmeans.getPhaseTimes();
+
+            times.load = load_time;
+            times.total = elapsed.count();
+            printPhaseTimes(std::cout, times);
+        }
+
+        if (!options.save_model.empty() && !saveModel(options.save_model, kmeans.getModel()))
+            MPI_Abort(MPI_COMM_WORLD, 1);
     }
 
     MPI_Finalize();
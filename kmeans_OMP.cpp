@@ -8,305 +8,670 @@
 #include <time.h>
 #include <algorithm>
 #include <chrono>
+#include <limits>
+#include <memory>
 #include <omp.h>
 
+#include "accumulate.h"
+#include "chunk_stream.h"
+#include "convergence.h"
+#include "dataset_file.h"
+#include "distance.h"
+#include "hamerly.h"
+#include "instrumentation.h"
+#include "kmeans_model.h"
+#include "lloyd_step.h"
+#include "minibatch.h"
+#include "options.h"
+#include "partial_sums.h"
+#include "phase_times.h"
+#include "point_matrix.h"
+#include "seeding.h"
+#include "work_stealing.h"
+
 using namespace std;
 
-class Point
+class Cluster
 {
 private:
-    int id_point, id_cluster;
-    vector<double> values;
-    int total_values;
-    string name;
+    int id_cluster;
+    vector<double> central_values;
+    int total_points; // number of member points, updated by the centroid step
 
 public:
-    Point(int id_point, vector<double> &values, string name = "")
+    Cluster(int id_cluster, const double *values, int total_values)
     {
-        this->id_point = id_point;
-        total_values = values.size();
+        this->id_cluster = id_cluster;
+        total_points = 0;
 
         for (int i = 0; i < total_values; i++)
-            this->values.push_back(values[i]);
-
-        this->name = name;
-        id_cluster = -1;
-    }
-
-    int getID()
-    {
-        return id_point;
+            central_values.push_back(values[i]);
     }
 
-    void setCluster(int id_cluster)
+    double getCentralValue(int index)
     {
-        this->id_cluster = id_cluster;
+        return central_values[index];
     }
 
-    int getCluster()
+    void setCentralValue(int index, double value)
     {
-        return id_cluster;
+        central_values[index] = value;
     }
 
-    double getValue(int index)
+    const double *getCentralValues()
     {
-        return values[index];
+        return central_values.data();
     }
 
-    int getTotalValues()
+    int getTotalPoints()
     {
-        return total_values;
+        return total_points;
     }
 
-    void addValue(double value)
+    void setTotalPoints(int total_points)
     {
-        values.push_back(value);
+        this->total_points = total_points;
     }
 
-    string getName()
+    int getID()
     {
-        return name;
+        return id_cluster;
     }
 };
 
-class Cluster
+class KMeans
 {
 private:
-    int id_cluster;
-    vector<double> central_values;
-    vector<Point> points;
+    int K; // number of clusters
+    int total_values, total_points, max_iterations;
+    Options options;
+    mt19937_64 rng; // seeded with options.seed, used by every random choice
+    vector<Cluster> clusters;
+    LloydStep step;              // fused assignment and accumulation, per-thread sums (lloyd_step.h)
+    HamerlyBounds bounds;        // used with --hamerly
+    bool stealing;               // --scheduler steal
+    StealingScheduler scheduler; // chunk deques of the threads, reset before every loop (work_stealing.h)
+    static const int cluster_grain = 4; // clusters per chunk in the centroid update
+    vector<long long> thread_changed;      // changed points of every thread, one cache line apart
+    vector<double> thread_inertia;         // same layout, filled when the inertia is measured
+    vector<double> thread_shift;           // largest center shift of every thread, same layout
+    static const int changed_stride = 8;
+
+    // --precision float: float coordinates, float centroid blocks and the
+    // float accumulation kernels (accumulate.h). The rows are those of a
+    // float PointMatrix, or of float_points, a copy made only when the points
+    // are double (--validate-precision keeps them for the reference run).
+    bool single_precision;
+    const float *float_rows;
+    AlignedFloatVector float_points;
+    FloatCenterBlocks float_blocks;
+    AccumulateFloatKernel accumulate_float;
+    AccumulateKahanKernel accumulate_kahan;
+    KahanPartialSums kahan_sums; // with --float-sums kahan
+    vector<double> kahan_totals;
+
+    PhaseTimes times;     // --phase-times, measured by thread 0
+    IterationTrace trace; // --trace, recorded by thread 0
+    ConvergenceCheck convergence;   // --tol-shift, --tol-inertia, --tol-changed (convergence.h)
+    ConvergenceReason stop_reason;  // criterion that ended the loop, set by thread 0
+    vector<double> initial_centers; // --warm-start, replaces the seeding when set
+    double final_inertia;           // of the last assignment, 0 when it was not measured
+
+    // return ID of nearest center (compares squared euclidean distances with
+    // the SIMD kernel selected at runtime, see distance.h)
+    int getIDNearestCenter(const double *point)
+    {
+        return step.nearest(point);
+    }
 
-public:
-    Cluster(int id_cluster, Point point)
+    // copies centroid i into the blocks read by the assignment kernels
+    void packCenter(int i)
     {
-        this->id_cluster = id_cluster;
+        step.setCenter(i, clusters[i].getCentralValues());
 
-        int total_values = point.getTotalValues();
+        if (single_precision)
+            float_blocks.setCenter(i, clusters[i].getCentralValues());
 
-        for (int i = 0; i < total_values; i++)
-            central_values.push_back(point.getValue(i));
+        if (options.hamerly)
+            bounds.setCenter(i, clusters[i].getCentralValues());
+    }
 
-        points.push_back(point);
+    void packCenters()
+    {
+        for (int i = 0; i < K; i++)
+            packCenter(i);
+
+        if (options.hamerly)
+            bounds.finishCenters();
     }
 
-    void addPoint(Point point)
+    // calls body(begin, end) for the items of the thread: its static share of
+    // [0, total_items), or with --scheduler steal the chunks it gets from the
+    // scheduler (refilled with the same total_items by startLoop)
+    template <typename Body>
+    void forEachRange(long long total_items, int thread, int total_threads, Body body)
     {
-        points.push_back(point);
+        if (stealing)
+        {
+            long long begin, end;
+
+            while (scheduler.next(thread, begin, end))
+                body(begin, end);
+        }
+        else
+            body(total_items * thread / total_threads, total_items * (thread + 1) / total_threads);
+    }
+
+    // start of a loop over total_items, reached by every thread of the
+    // region after a barrier (no thread may still be taking chunks of the
+    // previous loop): with --scheduler steal one thread refills the deques
+    // and the implicit barrier of single holds the others until it is done
+    void startLoop(long long total_items, int grain)
+    {
+        if (stealing)
+        {
+#pragma omp single
+            scheduler.reset(total_items, grain);
+        }
     }
 
-    bool removePoint(int id_point)
+    // associates each point to the nearest center and, in the same pass,
+    // adds it to the private sums of its thread: each thread labels a tile
+    // of its points and accumulates the tile while the rows are still in
+    // cache. Called by every thread of the region; returns the number of
+    // points of this thread that changed cluster.
+    long long assignAndAccumulate(PointMatrix &points, int thread, int total_threads)
     {
-        int total_points = points.size();
+        long long changed = 0;
+        double inertia = 0.0;
 
-        for (int i = 0; i < total_points; i++)
+        step.clear(thread);
+
+        forEachRange(total_points, thread, total_threads, [&](int begin, int end)
         {
-            if (points[i].getID() == id_point)
+            if (!options.hamerly)
             {
-                points.erase(points.begin() + i);
-                return true;
+                changed += step.assignAndAccumulate(points.data(), points.getClusters(), begin, end, thread,
+                                                    convergence.needsInertia(), inertia);
+                return;
             }
-        }
-        return false;
+
+            // the bounds label the points one by one
+            for (int tile = begin; tile < end; tile += LloydStep::tile_size)
+            {
+                int tile_end = min(tile + LloydStep::tile_size, end);
+
+                for (int i = tile; i < tile_end; i++)
+                {
+                    int id_old_cluster = points.getCluster(i);
+                    int id_nearest_center = bounds.assign(i, points.getRow(i), id_old_cluster);
+
+                    // cada thread escreve apenas o rótulo dos seus próprios pontos
+                    points.setCluster(i, id_nearest_center);
+
+                    if (id_old_cluster != id_nearest_center)
+                        changed++;
+
+                    if (convergence.needsInertia())
+                        inertia += squaredDistance(points.getRow(i), clusters[id_nearest_center].getCentralValues(), total_values);
+                }
+
+                step.accumulateTile(points.data(), points.getClusters(), tile, tile_end, thread);
+            }
+        });
+
+        if (convergence.needsInertia())
+            thread_inertia[thread * changed_stride] = inertia;
+
+        return changed;
     }
 
-    double getCentralValue(int index)
+    // single precision version of assignAndAccumulate: the rows are read from
+    // float_rows and the distances computed in float; the sums go to the
+    // double partial sums or, with --float-sums kahan, to the compensated
+    // float ones
+    long long assignAndAccumulateFloat(PointMatrix &points, int thread, int total_threads)
     {
-        return central_values[index];
+        bool kahan = options.float_sums == FLOAT_SUMS_KAHAN;
+        long long changed = 0;
+        double inertia = 0.0;
+
+        if (kahan)
+            kahan_sums.clear(thread);
+        else
+            step.clear(thread);
+
+        forEachRange(total_points, thread, total_threads, [&](int begin, int end)
+        {
+            for (int tile = begin; tile < end; tile += LloydStep::tile_size)
+            {
+                int tile_end = min(tile + LloydStep::tile_size, end);
+
+                for (int i = tile; i < tile_end; i++)
+                {
+                    int id_old_cluster = points.getCluster(i);
+                    int id_nearest_center = float_blocks.nearest(float_rows + (size_t)i * total_values);
+
+                    points.setCluster(i, id_nearest_center);
+
+                    if (id_old_cluster != id_nearest_center)
+                        changed++;
+
+                    // in double, from the float coordinates
+                    if (convergence.needsInertia())
+                        inertia += squaredDistance(float_rows + (size_t)i * total_values,
+                                                   clusters[id_nearest_center].getCentralValues(), total_values);
+                }
+
+                if (kahan)
+                    accumulate_kahan(float_rows, points.getClusters(), tile, tile_end, total_values,
+                                     kahan_sums.getSums(thread), kahan_sums.getCompensation(thread),
+                                     kahan_sums.getCounts(thread));
+                else
+                    accumulate_float(float_rows, points.getClusters(), tile, tile_end, total_values,
+                                     step.getPartialSums().getSums(thread), step.getPartialSums().getCounts(thread));
+            }
+        });
+
+        if (convergence.needsInertia())
+            thread_inertia[thread * changed_stride] = inertia;
+
+        return changed;
     }
 
-    void setCentralValue(int index, double value)
+    // tree reduction of the per-thread sums (partial_sums.h), ends with a barrier
+    void reduceSums(int thread, int total_threads)
     {
-        central_values[index] = value;
+        if (single_precision && options.float_sums == FLOAT_SUMS_KAHAN)
+            kahan_sums.reduce(thread, total_threads);
+        else
+            step.reduce(thread, total_threads);
     }
 
-    Point getPoint(int index)
+    // centroid i = sums of its points / number of points
+    void setCenterFromSums(int i, const double *sums, const int *counts)
     {
-        return points[index];
+        int total_points_cluster = counts[i];
+
+        clusters[i].setTotalPoints(total_points_cluster);
+
+        if (total_points_cluster > 0)
+        {
+            for (int j = 0; j < total_values; j++)
+                clusters[i].setCentralValue(j, sums[(size_t)i * total_values + j] / total_points_cluster);
+        }
     }
 
-    int getTotalPoints()
+    // recomputes every centroid from the reduced sums, called by every thread
+    // after reduceSums: the clusters (and, with Hamerly, the distances
+    // between the centers, K * K of them) are split between the threads.
+    // Ends with a barrier, so the next assignment sees every new center and
+    // the thread_shift slot of every thread is written.
+    void setCentersFromSums(int thread, int total_threads)
     {
-        return points.size();
+        double max_shift = 0.0;
+        const double *sums = step.getPartialSums().getSums(0);
+        const int *counts = step.getPartialSums().getCounts(0);
+
+        if (single_precision && options.float_sums == FLOAT_SUMS_KAHAN)
+        {
+#pragma omp single
+            kahan_sums.getTotals(kahan_totals.data());
+
+            sums = kahan_totals.data();
+            counts = kahan_sums.getCounts(0);
+        }
+
+        startLoop(K, cluster_grain);
+        forEachRange(K, thread, total_threads, [&](int begin, int end)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                setCenterFromSums(i, sums, counts);
+                packCenter(i);
+
+                if (convergence.needsShift())
+                    max_shift = max(max_shift, convergence.centerShift(i, clusters[i].getCentralValues()));
+            }
+        });
+
+        thread_shift[thread * changed_stride] = max_shift;
+
+        // every center has to be in place before the distances between them
+#pragma omp barrier
+
+        if (options.hamerly)
+        {
+            startLoop(K, cluster_grain);
+            forEachRange(K, thread, total_threads, [&](int begin, int end)
+            {
+                for (int i = begin; i < end; i++)
+                    bounds.measureCenter(i);
+            });
+
+#pragma omp barrier
+#pragma omp single
+            bounds.finishDrift();
+        }
     }
 
-    int getID()
+    // returns the indexes of the points of a cluster, built on demand from the labels
+    vector<int> getClusterPoints(PointMatrix &points, int id_cluster)
     {
-        return id_cluster;
+        vector<int> cluster_points;
+
+        for (int i = 0; i < total_points; i++)
+        {
+            if (points.getCluster(i) == id_cluster)
+                cluster_points.push_back(i);
+        }
+
+        return cluster_points;
     }
 
-    void clearPoints()
+    // mini-batch mode (--minibatch): replaces the Lloyd iterations by sampled
+    // steps, optionally followed by one full assignment pass (--final-pass)
+    void runMiniBatch(PointMatrix &points)
     {
-        points.clear();
-    }
-};
+        MiniBatch minibatch(K, total_values, parseSimdLevel(options.simd));
 
-class KMeans
-{
-private:
-    int K; // number of clusters
-    int total_values, total_points, max_iterations;
-    vector<Cluster> clusters;
+        for (int i = 0; i < K; i++)
+            minibatch.setCenter(i, clusters[i].getCentralValues());
 
-    // return ID of nearest center (uses euclidean distance)
-    int getIDNearestCenter(Point point)
-    {
-        double sum = 0.0, min_dist;
-        int id_cluster_center = 0;
+        minibatch.run(points, 0, total_points, options.minibatch_size, options.minibatch_iterations, rng());
 
-        for (int i = 0; i < total_values; i++)
+        for (int i = 0; i < K; i++)
         {
-            sum += pow(clusters[0].getCentralValue(i) -
-                           point.getValue(i),
-                       2.0);
+            for (int j = 0; j < total_values; j++)
+                clusters[i].setCentralValue(j, minibatch.getCenter(i)[j]);
         }
 
-        min_dist = sqrt(sum);
+        packCenters();
 
-        for (int i = 1; i < K; i++)
+        if (options.final_pass)
         {
-            double dist;
-            sum = 0.0;
+#pragma omp parallel for schedule(static)
+            for (int i = 0; i < total_points; i++)
+                points.setCluster(i, getIDNearestCenter(points.getRow(i)));
+        }
 
-            for (int j = 0; j < total_values; j++)
-            {
-                sum += pow(clusters[i].getCentralValue(j) -
-                               point.getValue(j),
-                           2.0);
-            }
+        cout << "Mini-batch: " << options.minibatch_iterations << " iterations of " << options.minibatch_size << " points\n\n";
+    }
 
-            dist = sqrt(sum);
+    // one record of the trace, by thread 0 after the update: the phase times,
+    // the points that changed, the inertia of the assignment and how far the
+    // centers moved
+    void traceIteration(int iter, double assign_time, double update_time, long long changed, double inertia,
+                        double max_shift)
+    {
+        IterationRecord record;
 
-            if (dist < min_dist)
-            {
-                min_dist = dist;
-                id_cluster_center = i;
-            }
-        }
+        record.iteration = iter;
+        record.assign_ns = toNanoseconds(assign_time);
+        record.update_ns = toNanoseconds(update_time);
+        record.changed = changed;
+        record.inertia = inertia;
+        record.max_shift = max_shift;
 
-        return id_cluster_center;
+        trace.addIteration(record);
     }
 
 public:
-    KMeans(int K, int total_points, int total_values, int max_iterations)
+    KMeans(int K, int total_points, int total_values, int max_iterations, const Options &options = Options())
     {
         this->K = K;
         this->total_points = total_points;
         this->total_values = total_values;
         this->max_iterations = max_iterations;
+        this->options = options;
+        stealing = options.scheduler == "steal";
+        rng.seed(options.seed);
+        // mini-batch runs in double
+        single_precision = options.precision == PRECISION_FLOAT && options.minibatch_size == 0;
+        float_rows = nullptr;
+        final_inertia = 0.0;
+    }
+
+    // starts the run from these centroids (K * total_values, row-major)
+    void setInitialCenters(const vector<double> &centers)
+    {
+        initial_centers = centers;
+    }
+
+    // final centroids, K * total_values row-major
+    vector<double> getCenters()
+    {
+        vector<double> centers;
+
+        for (int i = 0; i < (int)clusters.size(); i++)
+            centers.insert(centers.end(), clusters[i].getCentralValues(), clusters[i].getCentralValues() + total_values);
+
+        return centers;
+    }
+
+    // final centroids of the run, for --save-model
+    KMeansModel getModel()
+    {
+        KMeansModel model;
+
+        model.K = clusters.size();
+        model.total_values = total_values;
+        model.iterations = times.iterations;
+        model.total_points = total_points;
+        model.inertia = final_inertia;
+        model.centers = getCenters();
+
+        return model;
+    }
+
+    PhaseTimes &getPhaseTimes()
+    {
+        return times;
     }
 
-    void run(vector<Point> &points)
+    void run(PointMatrix &points)
     {
         if (K > total_points)
             return;
 
-        vector<int> prohibited_indexes;
+        PhaseClock clock;
 
-        // choose K distinct values for the centers of the clusters
-        for (int i = 0; i < K; i++)
+        // the GEMM engine replaces the direct double kernels, not the Hamerly
+        // bounds or the float ones
+        step = LloydStep(K, total_values, options.hamerly || single_precision ? "direct" : options.assign,
+                         options.gemm_threshold, parseSimdLevel(options.simd), omp_get_max_threads());
+
+        if (single_precision && points.isSinglePrecision())
+            float_rows = points.floatData();
+        else if (single_precision)
+        {
+            float_points.resize((size_t)total_points * total_values);
+
+#pragma omp parallel for schedule(static)
+            for (long long v = 0; v < (long long)total_points * total_values; v++)
+                float_points[v] = points.data()[v];
+
+            float_rows = float_points.data();
+        }
+
+        if (single_precision)
         {
-            while (true)
+            float_blocks = FloatCenterBlocks(K, total_values, parseSimdLevel(options.simd));
+            accumulate_float = selectAccumulateFloatKernel(total_values);
+            accumulate_kahan = selectAccumulateKahanKernel(total_values);
+            kahan_sums = KahanPartialSums(K, total_values, omp_get_max_threads());
+            kahan_totals.resize((size_t)K * total_values);
+        }
+
+        if (options.hamerly)
+            bounds = HamerlyBounds(total_points, K, total_values);
+
+        // with --warm-start the centers are the saved ones, otherwise choose
+        // K distinct points, with k-means++ by default or uniformly with
+        // --init random; the float path seeds from the float rows, so the run
+        // is the same whichever precision the points are stored in
+        if (!initial_centers.empty())
+        {
+            for (int i = 0; i < K; i++)
+                clusters.push_back(Cluster(i, &initial_centers[(size_t)i * total_values], total_values));
+        }
+        else
+        {
+            vector<int> seeds;
+            vector<double> seed_row(total_values);
+
+            if (options.init == "random")
+                seeds = chooseRandomSeeds(total_points, K, rng);
+            else if (single_precision)
+                seeds = chooseKMeansPlusPlusSeeds(float_rows, total_values, total_points, total_values, K, rng);
+            else
+                seeds = chooseKMeansPlusPlusSeeds(points, K, rng);
+
+            for (int i = 0; i < K; i++)
             {
-                int index_point = rand() % total_points;
+                int index_point = seeds[i];
+                const double *row = points.getRow(index_point);
 
-                if (find(prohibited_indexes.begin(), prohibited_indexes.end(),
-                         index_point) == prohibited_indexes.end())
+                if (single_precision)
                 {
-                    prohibited_indexes.push_back(index_point);
-                    points[index_point].setCluster(i);
-                    Cluster cluster(i, points[index_point]);
-                    clusters.push_back(cluster);
-                    break;
+                    copy(float_rows + (size_t)index_point * total_values,
+                         float_rows + (size_t)(index_point + 1) * total_values, seed_row.begin());
+                    row = seed_row.data();
                 }
+
+                points.setCluster(index_point, i);
+                Cluster cluster(i, row, total_values);
+                clusters.push_back(cluster);
             }
         }
 
+        packCenters();
+
+        if (options.minibatch_size > 0)
+        {
+            times.seed = clock.lap();
+            runMiniBatch(points);
+            times.assign = clock.lap();
+            times.iterations = options.minibatch_iterations;
+            return;
+        }
+
+        thread_changed.assign((size_t)omp_get_max_threads() * changed_stride, 0);
+        thread_inertia.assign((size_t)omp_get_max_threads() * changed_stride, 0.0);
+        thread_shift.assign((size_t)omp_get_max_threads() * changed_stride, 0.0);
+
+        // created once, reused by every loop of every iteration
+        if (stealing)
+            scheduler = StealingScheduler(omp_get_max_threads());
+
+        trace.start(options.trace, true, "omp", total_points, total_values, K, omp_get_max_threads(), 1);
+        convergence = ConvergenceCheck(options, total_points, K, total_values, trace.enabled());
+        for (int i = 0; i < K && convergence.needsShift(); i++)
+            convergence.setCenter(i, clusters[i].getCentralValues());
+        stop_reason = CONVERGENCE_NONE;
+
+        times.seed = clock.lap();
+
         int iter = 1;
 
-        while (true)
+        // the whole Lloyd loop runs in one parallel region: every phase is
+        // followed by a barrier instead of a fork/join, and all the buffers
+        // (partial sums, changed counts, scheduler deques) are allocated
+        // above, once per run
+#pragma omp parallel
         {
-            // Variável para sinalizar se houve mudança, compartilhada entre threads
-            bool done = true;
+            int thread = omp_get_thread_num(), total_threads = omp_get_num_threads();
 
-            // Cria um vetor para armazenar os IDs dos clusters para cada ponto
-            vector<int> new_clusters(total_points);
+            double assign_time = 0.0;
+            double previous_inertia = numeric_limits<double>::infinity(); // one copy per thread
 
-// associates each point to the nearest center
-#pragma omp parallel for schedule(static)
-            for (int i = 0; i < total_points; i++)
+            for (int iteration = 1;; iteration++)
             {
-                int id_old_cluster = points[i].getCluster();
-                int id_nearest_center = getIDNearestCenter(points[i]);
+                startLoop(total_points, options.grain);
 
-                new_clusters[i] = id_nearest_center;
+                // número de pontos que mudaram de cluster, somado entre as threads
+                thread_changed[thread * changed_stride] =
+                    single_precision ? assignAndAccumulateFloat(points, thread, total_threads)
+                                     : assignAndAccumulate(points, thread, total_threads);
 
-                if (id_old_cluster != id_nearest_center)
+                reduceSums(thread, total_threads);
+
+                // the assignment phase ends with the reduction of the sums
+                if (thread == 0)
                 {
-//seção crítica para atualizar 'done'
-#pragma omp atomic write
-                    done = false;
+                    assign_time = clock.lap();
+                    times.assign += assign_time;
                 }
-            }
 
-            //limpar pontos dos clusters antigos
-            for (int i = 0; i < K; i++)
-            {
-                clusters[i].clearPoints();
-            }
+                // reduction of the changed counts: after the barrier of
+                // reduceSums every thread adds the same slots, so they all
+                // take the same decision without a shared flag
+                long long changed = 0;
+                double inertia = 0.0;
+                for (int t = 0; t < total_threads; t++)
+                {
+                    changed += thread_changed[t * changed_stride];
+                    if (convergence.needsInertia())
+                        inertia += thread_inertia[t * changed_stride];
+                }
 
-            //reatribuir pontos aos clusters
-            for (int i = 0; i < total_points; i++)
-            {
-                points[i].setCluster(new_clusters[i]);
-                clusters[new_clusters[i]].addPoint(points[i]);
-            }
+                // recalculating the center of each cluster from the reduced sums
+                setCentersFromSums(thread, total_threads);
 
-// recalculating the center of each cluster
-#pragma omp parallel for schedule(static)
-            for (int i = 0; i < K; i++)
-            {
-                int total_points_cluster = clusters[i].getTotalPoints();
+                // same for the shifts: every thread checks the criteria on
+                // the same global values and reaches the same verdict
+                double max_shift = 0.0;
+                for (int t = 0; t < total_threads && convergence.needsShift(); t++)
+                    max_shift = max(max_shift, thread_shift[t * changed_stride]);
+
+                ConvergenceReason reason = convergence.check(changed, inertia, previous_inertia, max_shift);
+                previous_inertia = inertia;
 
-                if (total_points_cluster > 0)
+                if (thread == 0)
                 {
-                    for (int j = 0; j < total_values; j++)
-                    {
-                        double sum = 0.0;
+                    double update_time = clock.lap();
+                    times.update += update_time;
 
-// Paralelizar a soma dos pontos no cluster para cada dimensão
-#pragma omp parallel for reduction(+ : sum)
-                        for (int p = 0; p < total_points_cluster; p++)
-                        {
-                            sum += clusters[i].getPoint(p).getValue(j);
-                        }
+                    if (trace.enabled())
+                        traceIteration(iteration, assign_time, update_time, changed, inertia, max_shift);
+                }
 
-                        clusters[i].setCentralValue(j, sum / total_points_cluster);
+                if (reason != CONVERGENCE_NONE || iteration >= max_iterations)
+                {
+                    if (thread == 0)
+                    {
+                        iter = iteration;
+                        stop_reason = reason;
+                        final_inertia = inertia;
                     }
+                    break;
                 }
             }
+        }
 
-            if (done == true || iter >= max_iterations)
-            {
-                cout << "Break in iteration " << iter << "\n\n";
-                break;
-            }
+        times.iterations = iter;
+        trace.write();
+        if (stop_reason != CONVERGENCE_NONE && convergence.hasTolerance())
+            cout << "Converged: " << convergenceReasonName(stop_reason) << "\n";
+        cout << "Break in iteration " << iter << "\n\n";
 
-            iter++;
-        }
         /* Comentei essa parte, pois o tempo para printar todos os pontos é um procedimento muito custoso
                 // shows elements of clusters
                 for (int i = 0; i < K; i++)
                 {
-                    int total_points_cluster = clusters[i].getTotalPoints();
+                    vector<int> cluster_points = getClusterPoints(points, i);
+                    int total_points_cluster = cluster_points.size();
 
                     cout << "Cluster " << clusters[i].getID() + 1 << endl;
                     for (int j = 0; j < total_points_cluster; j++)
                     {
-                        cout << "Point " << clusters[i].getPoint(j).getID() + 1 << ": ";
+                        int id_point = cluster_points[j];
+
+                        cout << "Point " << points.getID(id_point) + 1 << ": ";
                         for (int p = 0; p < total_values; p++)
-                            cout << clusters[i].getPoint(j).getValue(p) << " ";
+                            cout << points.getValue(id_point, p) << " ";
 
-                        string point_name = clusters[i].getPoint(j).getName();
+                        string point_name = points.getName(id_point);
 
                         if (point_name != "")
                             cout << "- " << point_name;
@@ -323,63 +688,284 @@ public:
                 }
         */
     }
+
+    // --out-of-core: Lloyd iterations over a binary dataset that is never
+    // loaded, streamed from disk in chunks on every pass (chunk_stream.h).
+    // Each chunk goes through the tile loop of assignAndAccumulate (the
+    // GEMM engine or the tiled direct kernel) and the per-thread sums, which
+    // are reduced once per pass. Hamerly (N bounds), the float path (a float
+    // copy of the points) and mini-batch need all the points in memory and
+    // are not used. The seeds are K random rows read from the file
+    // (k-means++ would need K passes over it) or the --warm-start centroids.
+    void runStreaming(ChunkStream &stream)
+    {
+        if (K > total_points)
+            return;
+
+        PhaseClock clock;
+
+        single_precision = false;
+        step = LloydStep(K, total_values, options.assign, options.gemm_threshold, parseSimdLevel(options.simd),
+                         omp_get_max_threads());
+
+        thread_changed.assign((size_t)omp_get_max_threads() * changed_stride, 0);
+        thread_inertia.assign((size_t)omp_get_max_threads() * changed_stride, 0.0);
+        thread_shift.assign((size_t)omp_get_max_threads() * changed_stride, 0.0);
+
+        if (stealing)
+            scheduler = StealingScheduler(omp_get_max_threads());
+
+        if (!initial_centers.empty())
+        {
+            for (int i = 0; i < K; i++)
+                clusters.push_back(Cluster(i, &initial_centers[(size_t)i * total_values], total_values));
+        }
+        else
+        {
+            vector<double> row(total_values);
+
+            for (int index_point : chooseRandomSeeds(total_points, K, rng))
+            {
+                stream.readRow(index_point, row.data());
+                clusters.push_back(Cluster(clusters.size(), row.data(), total_values));
+            }
+        }
+
+        packCenters();
+
+        trace.start(options.trace, true, "omp-stream", total_points, total_values, K, omp_get_max_threads(), 1);
+        convergence = ConvergenceCheck(options, total_points, K, total_values, trace.enabled());
+        for (int i = 0; i < K && convergence.needsShift(); i++)
+            convergence.setCenter(i, clusters[i].getCentralValues());
+        stop_reason = CONVERGENCE_NONE;
+
+        stream.start();
+        times.seed = clock.lap();
+
+        int iter = 1;
+        StreamChunk chunk; // chunk being assigned, taken from the stream by one thread
+
+        // one parallel region for the whole loop, as in run(): one thread
+        // takes each chunk from the stream and every thread assigns its part
+        // of it, accumulating into its private sums until the end of the pass
+#pragma omp parallel
+        {
+            int thread = omp_get_thread_num(), total_threads = omp_get_num_threads();
+            double assign_time = 0.0;
+            double previous_inertia = numeric_limits<double>::infinity(); // one copy per thread
+
+            for (int iteration = 1;; iteration++)
+            {
+                long long changed = 0;
+                double inertia = 0.0;
+
+                step.clear(thread);
+
+                for (long long c = 0; c < stream.getTotalChunks(); c++)
+                {
+                    // next() releases the previous chunk, so every thread
+                    // must be done with it first
+#pragma omp barrier
+#pragma omp single
+                    chunk = stream.next();
+
+                    startLoop(chunk.count, options.grain);
+
+                    // the fused pass of assignAndAccumulate, over the rows of the chunk
+                    forEachRange(chunk.count, thread, total_threads, [&](int begin, int end)
+                    {
+                        changed += step.assignAndAccumulate(chunk.rows, chunk.labels, begin, end, thread,
+                                                            convergence.needsInertia(), inertia);
+                    });
+                }
+
+                thread_changed[thread * changed_stride] = changed;
+                thread_inertia[thread * changed_stride] = inertia;
+
+                reduceSums(thread, total_threads);
+
+                if (thread == 0)
+                {
+                    assign_time = clock.lap();
+                    times.assign += assign_time;
+                }
+
+                // global values read by every thread after the barrier of
+                // reduceSums, as in run()
+                changed = 0;
+                inertia = 0.0;
+                for (int t = 0; t < total_threads; t++)
+                {
+                    changed += thread_changed[t * changed_stride];
+                    inertia += thread_inertia[t * changed_stride];
+                }
+
+                setCentersFromSums(thread, total_threads);
+
+                double max_shift = 0.0;
+                for (int t = 0; t < total_threads && convergence.needsShift(); t++)
+                    max_shift = max(max_shift, thread_shift[t * changed_stride]);
+
+                ConvergenceReason reason = convergence.check(changed, inertia, previous_inertia, max_shift);
+                previous_inertia = inertia;
+
+                if (thread == 0)
+                {
+                    double update_time = clock.lap();
+                    times.update += update_time;
+
+                    if (trace.enabled())
+                        traceIteration(iteration, assign_time, update_time, changed, inertia, max_shift);
+                }
+
+                if (reason != CONVERGENCE_NONE || iteration >= max_iterations)
+                {
+                    if (thread == 0)
+                    {
+                        iter = iteration;
+                        stop_reason = reason;
+                        final_inertia = inertia;
+                    }
+                    break;
+                }
+            }
+        }
+
+        stream.stop();
+
+        times.iterations = iter;
+        trace.write();
+        if (stop_reason != CONVERGENCE_NONE && convergence.hasTolerance())
+            cout << "Converged: " << convergenceReasonName(stop_reason) << "\n";
+        cout << "Break in iteration " << iter << "\n\n";
+
+        cout << "Out-of-core: " << stream.getTotalChunks() << " chunks of " << stream.getChunkPoints()
+             << " points per pass, " << stream.getBufferBytes() / 1048576.0 << " MB of buffers, "
+             << stream.getWaitSeconds() << " s waiting for the disk\n\n";
+    }
 };
 
 int main(int argc, char *argv[])
 {
-    srand(0);
     //inicia o tempo
     auto start = std::chrono::high_resolution_clock::now();
 
-    // numero padrão de threads
-    int num_threads = 1; 
+    // numero de threads (padrão 1) e opções adicionais
+    Options options = parseOptions(argc, argv);
+    int num_threads = options.num_threads;
 
-    if (argc > 1)
+    // the Hamerly bounds are kept in double for every point, so they are not
+    // combined with the float assignment or with --out-of-core
+    if (options.hamerly && (options.precision == PRECISION_FLOAT || options.out_of_core))
     {
-        num_threads = atoi(argv[1]);
+        cerr << "Warning: --hamerly is ignored with " << (options.out_of_core ? "--out-of-core" : "--precision float")
+             << "\n";
+        options.hamerly = false;
     }
 
+    // semente fixa por padrão, para garantir reprodutibilidade nos testes
+    if (options.seed < 0)
+        options.seed = 0;
+
     //define o numero de threads para a paralelização
     omp_set_num_threads(num_threads);
 
-    int total_points, total_values, K, max_iterations, has_name;
-
-    cin >> total_points >> total_values >> K >> max_iterations >> has_name;
+    // text from stdin, or the --input file (a binary dataset is memory
+    // mapped); with --out-of-core only the header of the binary file is read
+    int K, max_iterations, total_points, total_values;
+    PhaseClock load_clock;
+    PointMatrix points;
+    unique_ptr<ChunkStream> stream;
 
-    vector<Point> points;
-    string point_name;
-
-    for (int i = 0; i < total_points; i++)
+    if (options.out_of_core)
     {
-        vector<double> values;
+        stream.reset(new ChunkStream(options.input, options.chunk_points));
+        K = stream->getK();
+        max_iterations = stream->getMaxIterations();
+        total_points = stream->getTotalPoints();
+        total_values = stream->getTotalValues();
+    }
+    else
+    {
+        // the float path keeps only float coordinates, unless the double
+        // reference run of --validate-precision needs them (mini-batch always
+        // runs in double)
+        bool single_precision =
+            options.precision == PRECISION_FLOAT && !options.validate_precision && options.minibatch_size == 0;
+
+        points = options.input.empty() ? readTextDataset(stdin, K, max_iterations)
+                                       : loadDataset(options.input, K, max_iterations, single_precision);
+        if (single_precision)
+            points.convertToFloat();
+        total_points = points.getTotalPoints();
+        total_values = points.getTotalValues();
+    }
+    double load_time = load_clock.lap();
 
-        for (int j = 0; j < total_values; j++)
-        {
-            double value;
-            cin >> value;
-            values.push_back(value);
-        }
+    KMeansModel warm_start;
+    if (!options.warm_start.empty() && !loadWarmStart(options.warm_start, K, total_values, warm_start))
+        return 1;
 
-        if (has_name)
-        {
-            cin >> point_name;
-            Point p(i, values, point_name);
-            points.push_back(p);
-        }
-        else
-        {
-            Point p(i, values);
-            points.push_back(p);
-        }
-    }
+    KMeans kmeans(K, total_points, total_values, max_iterations, options);
+    if (!warm_start.centers.empty())
+        kmeans.setInitialCenters(warm_start.centers);
 
-    KMeans kmeans(K, total_points, total_values, max_iterations);
-    kmeans.run(points);
+    if (stream)
+        kmeans.runStreaming(*stream);
+    else
+        kmeans.run(points);
 
     //finaliza o tempo
     auto finish = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double> elapsed = finish - start;
     std::cout << "Tempo de execução com " << num_threads << " thread(s): " << elapsed.count() << " segundos\n";
 
+    if (options.phase_times)
+    {
+        PhaseTimes &times = kmeans.getPhaseTimes();
+
+        times.load = load_time;
+        times.total = elapsed.count();
+        printPhaseTimes(std::cout, times);
+    }
+
+    if (!options.save_model.empty() && !saveModel(options.save_model, kmeans.getModel()))
+        return 1;
+
+    // --validate-precision: repete a execução em double, a partir da mesma
+    // semente, e mede a divergência dos rótulos e dos centroides
+    if (options.validate_precision && options.precision != PRECISION_DOUBLE && !stream)
+    {
+        vector<int> labels(points.getClusters(), points.getClusters() + total_points);
+        vector<double> centers = kmeans.getCenters();
+
+        for (int i = 0; i < total_points; i++)
+            points.setCluster(i, -1);
+
+        Options reference_options = options;
+        reference_options.precision = PRECISION_DOUBLE;
+        reference_options.trace = "";
+
+        KMeans reference(K, total_points, total_values, max_iterations, reference_options);
+        if (!warm_start.centers.empty())
+            reference.setInitialCenters(warm_start.centers);
+        reference.run(points);
+
+        vector<double> reference_centers = reference.getCenters();
+        long long different = 0;
+        double max_shift = 0.0;
+
+        for (int i = 0; i < total_points; i++)
+            different += labels[i] != points.getCluster(i);
+
+        for (size_t v = 0; v < centers.size() && v < reference_centers.size(); v++)
+            max_shift = max(max_shift, fabs(centers[v] - reference_centers[v]));
+
+        std::cout << "Precision check (" << precisionName(options.precision) << ", sums "
+                  << floatSumsName(options.float_sums) << "): " << different << " of " << total_points
+                  << " labels differ from the double run ("
+                  << 100.0 * different / max(total_points, 1) << "%), max centroid difference " << max_shift << "\n";
+    }
+
     return 0;
 }
@@ -0,0 +1,467 @@
+// Benchmark harness for the serial, OpenMP and MPI versions.
+//
+// For every combination of --n, --d and --k a synthetic dataset is generated
+// in-process (the distribution of generateDataset.py, see generateDataset)
+// and written in the binary format to the work directory. Every build is
+// then run --repeats times per thread count (and rank count, for MPI) with
+// --phase-times, and the "Phase times:" lines are collected: median, 10th
+// and 90th percentile of every phase, points per second of the iterations
+// (N * iterations / (assign + update + communicate)) and the speedup and
+// efficiency of that rate against the serial build (or the first
+// configuration when the serial build is not in the sweep). The rate, not
+// the loop time, is compared because the MPI seeding (k-means||) can change
+// the number of iterations.
+//
+// Usage:
+//   kmeans_bench [--n 100000,1000000] [--d 4] [--k 3] [--threads 1,2,4]
+//                [--ranks 1,2] [--builds serial,omp,mpi] [--repeats 5]
+//                [--warmup 1] [--max-iterations 100] [--seed 1]
+//                [--bin-dir .] [--work-dir .] [--mpirun "mpirun"]
+//                [--args "--hamerly"] [--json out.json] [--csv out.csv]
+//                [--keep-data]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dataset_file.h"
+#include "phase_times.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+using namespace std;
+
+struct BenchOptions
+{
+    vector<long long> sizes = {100000};
+    vector<long long> dimensions = {4};
+    vector<long long> cluster_counts = {3};
+    vector<long long> threads = {1, 2, 4};
+    vector<long long> ranks = {1, 2};
+    vector<string> builds = {"serial", "omp", "mpi"};
+    int repeats = 5;
+    int warmup = 1; // runs discarded before the measured ones
+    int max_iterations = 100;
+    long long seed = 1;
+    string bin_dir = ".";
+    string work_dir = ".";
+    string mpirun = "mpirun";
+    string extra_args = ""; // passed to every run, e.g. "--hamerly"
+    string json = "";
+    string csv = "";
+    bool keep_data = false;
+};
+
+// median and percentiles of one phase over the repeats
+struct PhaseStats
+{
+    double median = 0.0, p10 = 0.0, p90 = 0.0;
+};
+
+struct BenchResult
+{
+    string build;
+    long long total_points, total_values, K, ranks, threads;
+    int repeats, iterations;
+    PhaseStats load, seed, assign, update, communicate, total, loop;
+    double points_per_second, speedup, efficiency;
+};
+
+template <typename T>
+vector<T> splitList(const string &text, T (*convert)(const string &))
+{
+    vector<T> values;
+    stringstream stream(text);
+    string item;
+
+    while (getline(stream, item, ','))
+    {
+        if (!item.empty())
+            values.push_back(convert(item));
+    }
+
+    return values;
+}
+
+long long toNumber(const string &text)
+{
+    return atoll(text.c_str());
+}
+
+string toString(const string &text)
+{
+    return text;
+}
+
+BenchOptions parseBenchOptions(int argc, char *argv[])
+{
+    BenchOptions options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--n" && has_value)
+            options.sizes = splitList(argv[++i], toNumber);
+        else if (arg == "--d" && has_value)
+            options.dimensions = splitList(argv[++i], toNumber);
+        else if (arg == "--k" && has_value)
+            options.cluster_counts = splitList(argv[++i], toNumber);
+        else if (arg == "--threads" && has_value)
+            options.threads = splitList(argv[++i], toNumber);
+        else if (arg == "--ranks" && has_value)
+            options.ranks = splitList(argv[++i], toNumber);
+        else if (arg == "--builds" && has_value)
+            options.builds = splitList(argv[++i], toString);
+        else if (arg == "--repeats" && has_value)
+            options.repeats = max(1, atoi(argv[++i]));
+        else if (arg == "--warmup" && has_value)
+            options.warmup = max(0, atoi(argv[++i]));
+        else if (arg == "--max-iterations" && has_value)
+            options.max_iterations = atoi(argv[++i]);
+        else if (arg == "--seed" && has_value)
+            options.seed = atoll(argv[++i]);
+        else if (arg == "--bin-dir" && has_value)
+            options.bin_dir = argv[++i];
+        else if (arg == "--work-dir" && has_value)
+            options.work_dir = argv[++i];
+        else if (arg == "--mpirun" && has_value)
+            options.mpirun = argv[++i];
+        else if (arg == "--args" && has_value)
+            options.extra_args = argv[++i];
+        else if (arg == "--json" && has_value)
+            options.json = argv[++i];
+        else if (arg == "--csv" && has_value)
+            options.csv = argv[++i];
+        else if (arg == "--keep-data")
+            options.keep_data = true;
+        else
+            cerr << "Ignoring unknown option " << arg << "\n";
+    }
+
+    return options;
+}
+
+// Same distribution as generateDataset.py: every cluster is a box and its
+// points are uniform inside it, with the cluster name after the values. For
+// D = 4 and K = 3 the boxes are the three Iris species of the script; any
+// other shape gets K random boxes of similar extent (corner in [0, 8), side
+// in [0.5, 2.5) in every dimension). The points of cluster c are the
+// consecutive block [N * c / K, N * (c + 1) / K), as in the script.
+PointMatrix generateDataset(int total_points, int total_values, int K, long long seed)
+{
+    static const double iris_low[3][4] = {{4.3, 2.3, 1.0, 0.1}, {4.9, 2.0, 3.0, 1.0}, {5.8, 2.5, 4.5, 1.4}};
+    static const double iris_high[3][4] = {{5.8, 4.4, 1.9, 0.6}, {7.0, 3.4, 5.1, 1.8}, {7.9, 3.8, 6.9, 2.5}};
+    static const char *iris_names[3] = {"Iris-setosa", "Iris-versicolor", "Iris-virginica"};
+
+    bool iris = total_values == 4 && K == 3;
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> corner(0.0, 8.0), side(0.5, 2.5);
+    vector<double> low((size_t)K * total_values), high((size_t)K * total_values);
+
+    for (int c = 0; c < K; c++)
+    {
+        for (int j = 0; j < total_values; j++)
+        {
+            size_t v = (size_t)c * total_values + j;
+
+            low[v] = iris ? iris_low[c][j] : corner(rng);
+            high[v] = iris ? iris_high[c][j] : low[v] + side(rng);
+        }
+    }
+
+    PointMatrix points(total_points, total_values, true);
+
+    for (int c = 0; c < K; c++)
+    {
+        int id_name = points.internName(iris ? string(iris_names[c]) : "Cluster-" + to_string(c + 1));
+        int begin = (long long)total_points * c / K, end = (long long)total_points * (c + 1) / K;
+
+        for (int i = begin; i < end; i++)
+        {
+            double *row = points.getRow(i);
+
+            for (int j = 0; j < total_values; j++)
+            {
+                size_t v = (size_t)c * total_values + j;
+                row[j] = uniform_real_distribution<double>(low[v], high[v])(rng);
+            }
+
+            points.setNameID(i, id_name);
+        }
+    }
+
+    return points;
+}
+
+// runs the command and reads the "Phase times:" line of its output
+bool runOnce(const string &command, PhaseTimes &times)
+{
+    FILE *pipe = popen(command.c_str(), "r");
+
+    if (!pipe)
+        return false;
+
+    char line[4096];
+    bool found = false;
+
+    while (fgets(line, sizeof(line), pipe))
+    {
+        if (sscanf(line, "Phase times: load=%lf seed=%lf assign=%lf update=%lf communicate=%lf total=%lf iterations=%d",
+                   &times.load, &times.seed, &times.assign, &times.update, &times.communicate, &times.total,
+                   &times.iterations) == 7)
+            found = true;
+    }
+
+    return pclose(pipe) == 0 && found;
+}
+
+// linear interpolation between the closest ranks
+double percentile(vector<double> values, double fraction)
+{
+    sort(values.begin(), values.end());
+
+    double position = fraction * (values.size() - 1);
+    size_t below = (size_t)position;
+    size_t above = min(below + 1, values.size() - 1);
+
+    return values[below] + (position - below) * (values[above] - values[below]);
+}
+
+PhaseStats phaseStats(const vector<PhaseTimes> &runs, double (*phase)(const PhaseTimes &))
+{
+    vector<double> values;
+    PhaseStats stats;
+
+    for (const PhaseTimes &times : runs)
+        values.push_back(phase(times));
+
+    stats.median = percentile(values, 0.5);
+    stats.p10 = percentile(values, 0.1);
+    stats.p90 = percentile(values, 0.9);
+    return stats;
+}
+
+string buildCommand(const BenchOptions &options, const string &build, long long ranks, long long threads,
+                    const string &dataset)
+{
+    stringstream command;
+    string binary = build == "serial" ? "kmeans" : build == "omp" ? "kmeans_OMP" : "kmeans_MPI";
+
+    if (build == "mpi")
+        command << options.mpirun << " -np " << ranks << " ";
+
+    command << "\"" << options.bin_dir << "/" << binary << "\" " << threads << " --input \"" << dataset
+            << "\" --seed " << options.seed << " --phase-times " << options.extra_args << " 2>&1";
+    return command.str();
+}
+
+void writeStats(ostream &out, const char *name, const PhaseStats &stats)
+{
+    out << "\"" << name << "\": {\"median\": " << stats.median << ", \"p10\": " << stats.p10 << ", \"p90\": "
+        << stats.p90 << "}";
+}
+
+void writeJson(const string &path, const vector<BenchResult> &results)
+{
+    ofstream out(path);
+
+    out << setprecision(9) << "[\n";
+    for (size_t r = 0; r < results.size(); r++)
+    {
+        const BenchResult &result = results[r];
+
+        out << "  {\"build\": \"" << result.build << "\", \"n\": " << result.total_points << ", \"d\": "
+            << result.total_values << ", \"k\": " << result.K << ", \"ranks\": " << result.ranks
+            << ", \"threads\": " << result.threads << ", \"repeats\": " << result.repeats
+            << ", \"iterations\": " << result.iterations << ",\n   ";
+        writeStats(out, "load", result.load);
+        out << ", ";
+        writeStats(out, "seed", result.seed);
+        out << ",\n   ";
+        writeStats(out, "assign", result.assign);
+        out << ", ";
+        writeStats(out, "update", result.update);
+        out << ",\n   ";
+        writeStats(out, "communicate", result.communicate);
+        out << ", ";
+        writeStats(out, "total", result.total);
+        out << ",\n   ";
+        writeStats(out, "loop", result.loop);
+        out << ",\n   \"points_per_second\": " << result.points_per_second << ", \"speedup\": " << result.speedup
+            << ", \"efficiency\": " << result.efficiency << "}" << (r + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+void writeCsv(const string &path, const vector<BenchResult> &results)
+{
+    ofstream out(path);
+    const char *phases[] = {"load", "seed", "assign", "update", "communicate", "total", "loop"};
+
+    out << "build,n,d,k,ranks,threads,repeats,iterations";
+    for (const char *phase : phases)
+        out << "," << phase << "_median," << phase << "_p10," << phase << "_p90";
+    out << ",points_per_second,speedup,efficiency\n";
+
+    out << setprecision(9);
+    for (const BenchResult &result : results)
+    {
+        const PhaseStats *stats[] = {&result.load,        &result.seed,  &result.assign, &result.update,
+                                     &result.communicate, &result.total, &result.loop};
+
+        out << result.build << "," << result.total_points << "," << result.total_values << "," << result.K << ","
+            << result.ranks << "," << result.threads << "," << result.repeats << "," << result.iterations;
+        for (const PhaseStats *phase : stats)
+            out << "," << phase->median << "," << phase->p10 << "," << phase->p90;
+        out << "," << result.points_per_second << "," << result.speedup << "," << result.efficiency << "\n";
+    }
+}
+
+void printTable(const vector<BenchResult> &results)
+{
+    cout << left << setw(7) << "build" << right << setw(10) << "N" << setw(5) << "D" << setw(6) << "K" << setw(6)
+         << "ranks" << setw(8) << "threads" << setw(6) << "iters" << setw(10) << "load" << setw(10) << "seed"
+         << setw(10) << "assign" << setw(10) << "update" << setw(10) << "comm" << setw(10) << "loop" << setw(10)
+         << "loop p90" << setw(12) << "Mpoints/s" << setw(9) << "speedup" << setw(8) << "eff" << "\n";
+
+    cout << fixed;
+    for (const BenchResult &result : results)
+    {
+        cout << left << setw(7) << result.build << right << setw(10) << result.total_points << setw(5)
+             << result.total_values << setw(6) << result.K << setw(6) << result.ranks << setw(8) << result.threads
+             << setw(6) << result.iterations << setprecision(4) << setw(10) << result.load.median << setw(10)
+             << result.seed.median << setw(10) << result.assign.median << setw(10) << result.update.median
+             << setw(10) << result.communicate.median << setw(10) << result.loop.median << setw(10)
+             << result.loop.p90 << setprecision(2) << setw(12) << result.points_per_second / 1e6 << setw(9)
+             << result.speedup << setw(8) << result.efficiency << "\n";
+    }
+    cout.unsetf(ios::fixed);
+}
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options = parseBenchOptions(argc, argv);
+    vector<BenchResult> results;
+    bool failed = false;
+
+    cerr << "Medians of " << options.repeats << " runs (seconds); loop = assign + update + communicate\n";
+
+    for (long long total_points : options.sizes)
+    {
+        for (long long total_values : options.dimensions)
+        {
+            for (long long K : options.cluster_counts)
+            {
+                string dataset = options.work_dir + "/kmeans_bench_" + to_string(total_points) + "_" +
+                                 to_string(total_values) + "_" + to_string(K) + ".bin";
+                PointMatrix points = generateDataset(total_points, total_values, K, options.seed);
+
+                if (!writeBinaryDataset(dataset, points, K, options.max_iterations))
+                {
+                    cerr << dataset << ": write failed\n";
+                    return 1;
+                }
+
+                size_t first_result = results.size();
+                double baseline_rate = 0.0;
+
+                for (const string &build : options.builds)
+                {
+                    vector<long long> rank_counts = build == "mpi" ? options.ranks : vector<long long>{1};
+                    vector<long long> thread_counts = build == "serial" ? vector<long long>{1} : options.threads;
+
+                    for (long long ranks : rank_counts)
+                    {
+                        for (long long threads : thread_counts)
+                        {
+                            string command = buildCommand(options, build, ranks, threads, dataset);
+                            vector<PhaseTimes> runs;
+                            bool ok = true;
+
+                            for (int r = 0; r < options.warmup + options.repeats && ok; r++)
+                            {
+                                PhaseTimes times;
+
+                                ok = runOnce(command, times);
+                                if (ok && r >= options.warmup)
+                                    runs.push_back(times);
+                            }
+
+                            if (!ok)
+                            {
+                                cerr << "Failed: " << command << "\n";
+                                failed = true;
+                                continue;
+                            }
+
+                            BenchResult result;
+                            result.build = build;
+                            result.total_points = total_points;
+                            result.total_values = total_values;
+                            result.K = K;
+                            result.ranks = ranks;
+                            result.threads = threads;
+                            result.repeats = runs.size();
+                            result.load = phaseStats(runs, [](const PhaseTimes &t) { return t.load; });
+                            result.seed = phaseStats(runs, [](const PhaseTimes &t) { return t.seed; });
+                            result.assign = phaseStats(runs, [](const PhaseTimes &t) { return t.assign; });
+                            result.update = phaseStats(runs, [](const PhaseTimes &t) { return t.update; });
+                            result.communicate = phaseStats(runs, [](const PhaseTimes &t) { return t.communicate; });
+                            result.total = phaseStats(runs, [](const PhaseTimes &t) { return t.total; });
+                            result.loop = phaseStats(runs, [](const PhaseTimes &t) { return t.assign + t.update + t.communicate; });
+
+                            vector<double> iterations, rates;
+                            for (const PhaseTimes &times : runs)
+                            {
+                                double loop = times.assign + times.update + times.communicate;
+
+                                iterations.push_back(times.iterations);
+                                rates.push_back(loop > 0.0 ? (double)total_points * times.iterations / loop : 0.0);
+                            }
+                            result.iterations = percentile(iterations, 0.5);
+                            result.points_per_second = percentile(rates, 0.5);
+
+                            // the first configuration is the baseline unless the serial build is swept
+                            if (results.size() == first_result || build == "serial")
+                                baseline_rate = result.points_per_second;
+
+                            results.push_back(result);
+                        }
+                    }
+                }
+
+                for (size_t r = first_result; r < results.size(); r++)
+                {
+                    BenchResult &result = results[r];
+
+                    result.speedup = baseline_rate > 0.0 ? result.points_per_second / baseline_rate : 0.0;
+                    result.efficiency = result.speedup / (result.ranks * result.threads);
+                }
+
+                if (!options.keep_data)
+                    remove(dataset.c_str());
+            }
+        }
+    }
+
+    printTable(results);
+
+    if (!options.json.empty())
+        writeJson(options.json, results);
+    if (!options.csv.empty())
+        writeCsv(options.csv, results);
+
+    return failed ? 1 : 0;
+}
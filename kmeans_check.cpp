@@ -0,0 +1,322 @@
+// Consistency checks of the parts that the executables do not exercise on
+// every run. Every check prints "ok" or "FAIL" and a description; the exit
+// code is 1 when a check failed.
+//
+//   chunk stream   ChunkStream (chunk_stream.h) over small binary datasets
+//                  and every chunk size that matters for them, including a
+//                  single point (one chunk, no scratch file): the rows and
+//                  the labels written in a pass must come back in the next
+//                  ones. kmeans_OMP --out-of-core is also run on the
+//                  one-point dataset.
+//   library        fitKMeans (kmeans_lib.h) against kmeans_OMP: both start
+//                  from the same saved model (--warm-start) on a small
+//                  synthetic dataset and must end with the same centroids
+//                  and number of iterations. A strided view of the same
+//                  points, a warm start from the result and the labels of
+//                  KMeansPredictor must agree with it as well. Both run
+//                  the Lloyd pass of lloyd_step.h, so this covers what
+//                  differs between them: the warm start, the split of the
+//                  rows and the stopping criteria.
+//
+// Usage:
+//   kmeans_check [--bin-dir .] [--work-dir .] [--keep-data]
+//
+// The datasets are written to --work-dir; kmeans_OMP is taken from
+// --bin-dir.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "chunk_stream.h"
+#include "dataset_file.h"
+#include "kmeans_lib.h"
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#endif
+
+using namespace std;
+
+struct CheckOptions
+{
+    string bin_dir = ".";
+    string work_dir = ".";
+    bool keep_data = false;
+};
+
+CheckOptions parseCheckOptions(int argc, char *argv[])
+{
+    CheckOptions options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--bin-dir" && has_value)
+            options.bin_dir = argv[++i];
+        else if (arg == "--work-dir" && has_value)
+            options.work_dir = argv[++i];
+        else if (arg == "--keep-data")
+            options.keep_data = true;
+        else
+            cerr << "Ignoring unknown option " << arg << "\n";
+    }
+
+    return options;
+}
+
+int failed_checks = 0;
+
+void report(bool passed, const string &description)
+{
+    cout << (passed ? "ok   " : "FAIL ") << description << "\n";
+
+    if (!passed)
+        failed_checks++;
+}
+
+// runs the command and returns its exit status, with the standard output in
+// output
+int runCommand(const string &command, string &output)
+{
+    FILE *pipe = popen(command.c_str(), "r");
+
+    if (!pipe)
+        return -1;
+
+    char line[4096];
+    output.clear();
+
+    while (fgets(line, sizeof(line), pipe))
+        output += line;
+
+    return pclose(pipe);
+}
+
+// row i of the chunk stream datasets: (i, i + 0.5, ...)
+double streamValue(int index, int value)
+{
+    return index + 0.5 * value;
+}
+
+string writeStreamDataset(const CheckOptions &options, int total_points, int total_values)
+{
+    string path = options.work_dir + "/check_stream_" + to_string(total_points) + ".bin";
+    PointMatrix points(total_points, total_values);
+
+    for (int i = 0; i < total_points; i++)
+    {
+        for (int j = 0; j < total_values; j++)
+            points.setValue(i, j, streamValue(i, j));
+    }
+
+    if (!writeBinaryDataset(path, points, 1, 10))
+        cerr << path << ": cannot write the dataset\n";
+
+    return path;
+}
+
+// three passes over the dataset: every row must be read back, and every
+// label must hold what the previous pass wrote (-1 in the first pass)
+void checkChunkStream(const string &path, int total_points, int total_values, int chunk_points)
+{
+    const int total_passes = 3;
+    ChunkStream stream(path, chunk_points);
+    bool passed = stream.getTotalPoints() == total_points && stream.getTotalValues() == total_values;
+
+    stream.start();
+
+    for (int pass = 0; pass < total_passes && passed; pass++)
+    {
+        long long seen = 0;
+
+        for (long long c = 0; c < stream.getTotalChunks(); c++)
+        {
+            StreamChunk chunk = stream.next();
+
+            for (int i = 0; i < chunk.count; i++)
+            {
+                int index = chunk.first + i;
+                int expected = pass == 0 ? -1 : (pass - 1) * 1000 + index;
+
+                for (int j = 0; j < total_values; j++)
+                    passed = passed && chunk.rows[(size_t)i * total_values + j] == streamValue(index, j);
+
+                passed = passed && chunk.labels[i] == expected;
+                chunk.labels[i] = pass * 1000 + index;
+            }
+
+            seen += chunk.count;
+        }
+
+        passed = passed && seen == total_points;
+    }
+
+    stream.stop();
+
+    stringstream description;
+    description << "chunk stream N=" << total_points << " --chunk-points " << chunk_points << " ("
+                << stream.getTotalChunks() << " chunks of " << stream.getChunkPoints() << ")";
+    report(passed, description.str());
+}
+
+void checkStreaming(const CheckOptions &options)
+{
+    const int total_values = 3;
+    vector<string> paths;
+
+    for (int total_points : {1, 2, 3, 5, 17})
+    {
+        string path = writeStreamDataset(options, total_points, total_values);
+        paths.push_back(path);
+
+        for (int chunk_points : {1, 2, 4, 64})
+            checkChunkStream(path, total_points, total_values, chunk_points);
+    }
+
+    // the whole out-of-core run on a single point
+    string output;
+    int status = runCommand(options.bin_dir + "/kmeans_OMP 2 --out-of-core --input " + paths[0], output);
+    report(status == 0 && output.find("Break in iteration") != string::npos, "kmeans_OMP --out-of-core with N=1");
+
+    if (!options.keep_data)
+    {
+        for (const string &path : paths)
+            remove(path.c_str());
+    }
+}
+
+// largest difference between the coordinates of two models of the same shape
+double centerDifference(const KMeansModel &a, const KMeansModel &b)
+{
+    if (a.K != b.K || a.total_values != b.total_values)
+        return INFINITY;
+
+    double difference = 0.0;
+
+    for (size_t v = 0; v < a.centers.size(); v++)
+        difference = max(difference, fabs(a.centers[v] - b.centers[v]));
+
+    return difference;
+}
+
+// K gaussian blobs with random centers in [0, 10)^D
+PointMatrix generateBlobs(int total_points, int total_values, int K, long long seed)
+{
+    mt19937_64 rng(seed);
+    uniform_real_distribution<double> corner(0.0, 10.0);
+    normal_distribution<double> noise(0.0, 0.6);
+    vector<double> means((size_t)K * total_values);
+    PointMatrix points(total_points, total_values);
+
+    for (double &mean : means)
+        mean = corner(rng);
+
+    for (int i = 0; i < total_points; i++)
+    {
+        int c = i % K;
+
+        for (int j = 0; j < total_values; j++)
+            points.setValue(i, j, means[(size_t)c * total_values + j] + noise(rng));
+    }
+
+    return points;
+}
+
+void checkLibrary(const CheckOptions &options)
+{
+    const int total_points = 2000, total_values = 6, K = 5, max_iterations = 200;
+    const double tolerance = 1e-9; // the threads add the points in a different order
+    string data_path = options.work_dir + "/check_fit.bin";
+    string start_path = options.work_dir + "/check_start.model";
+    string omp_path = options.work_dir + "/check_omp.model";
+
+    PointMatrix points = generateBlobs(total_points, total_values, K, 7);
+    DataView data(points.data(), total_points, total_values);
+
+    // a rough starting model: two iterations from random seeds
+    Options rough_options;
+    rough_options.init = "random";
+    KMeansResult rough;
+
+    if (!writeBinaryDataset(data_path, points, K, max_iterations) || !fitKMeans(data, K, 2, rough, rough_options) ||
+        !saveModel(start_path, rough.model))
+    {
+        report(false, "library: cannot prepare the dataset and the starting model in " + options.work_dir);
+        return;
+    }
+
+    KMeansResult fit;
+    bool fitted = fitKMeans(data, K, max_iterations, fit, Options(), &rough.model);
+    report(fitted && fit.converged, "fitKMeans with --warm-start converges (" + to_string(fit.model.iterations) +
+                                        " iterations, " + fit.reason + ")");
+
+    for (int threads : {1, 3})
+    {
+        string output;
+        int status = runCommand(options.bin_dir + "/kmeans_OMP " + to_string(threads) + " --input " + data_path +
+                                    " --warm-start " + start_path + " --save-model " + omp_path,
+                                output);
+        KMeansModel omp;
+        bool loaded = status == 0 && loadModel(omp_path, omp);
+
+        stringstream description;
+        description << "fitKMeans matches kmeans_OMP " << threads << " thread(s): iterations " << fit.model.iterations
+                    << " / " << omp.iterations << ", max centroid difference " << centerDifference(fit.model, omp);
+        report(loaded && omp.iterations == fit.model.iterations && centerDifference(fit.model, omp) <= tolerance,
+               description.str());
+    }
+
+    // the same points as columns [2, 2 + D) of a wider table
+    size_t stride = total_values + 3;
+    vector<double> table((size_t)total_points * stride, -1.0);
+
+    for (int i = 0; i < total_points; i++)
+        copy(points.getRow(i), points.getRow(i) + total_values, table.begin() + i * stride + 2);
+
+    KMeansResult strided;
+    fitKMeans(DataView(table.data() + 2, total_points, total_values, stride), K, max_iterations, strided, Options(),
+              &rough.model);
+    report(strided.model.iterations == fit.model.iterations && strided.labels == fit.labels &&
+               centerDifference(strided.model, fit.model) == 0.0,
+           "fitKMeans on a strided view matches the contiguous one");
+
+    // a warm start from a converged model keeps it: the first iteration
+    // assigns every point, the second one changes none
+    KMeansResult again;
+    fitKMeans(data, K, max_iterations, again, Options(), &fit.model);
+    report(again.converged && again.model.iterations == 2 && centerDifference(again.model, fit.model) <= tolerance,
+           "a warm start from the result stops at the second iteration");
+
+    KMeansPredictor predictor(fit.model);
+    vector<int> labels(total_points);
+    predictor.predict(data, labels.data());
+    report(labels == fit.labels, "KMeansPredictor labels the points as fitKMeans");
+
+    if (!options.keep_data)
+    {
+        remove(data_path.c_str());
+        remove(start_path.c_str());
+        remove(omp_path.c_str());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    CheckOptions options = parseCheckOptions(argc, argv);
+
+    checkStreaming(options);
+    checkLibrary(options);
+
+    cout << failed_checks << " check(s) failed\n";
+    return failed_checks > 0 ? 1 : 0;
+}
@@ -0,0 +1,288 @@
+// K-means as a library call, for programs that already hold their points in
+// memory (the executables read a dataset file and only print the result).
+//
+//   DataView data(values, total_points, total_values, stride);
+//   KMeansResult result;
+//
+//   if (fitKMeans(data, K, max_iterations, result, options))
+//       saveModel("centers.model", result.model);
+//
+//   // a later run on new data starts from the saved centroids
+//   KMeansModel model;
+//   if (loadModel("centers.model", model))
+//       fitKMeans(data, K, max_iterations, result, options, &model);
+//
+// The view reads the rows in place, row i starting at values + i * stride
+// (stride >= total_values doubles), so a range of columns of a wider table
+// is clustered without a copy (the kernels read it one copied tile at a
+// time). The Lloyd iterations split the rows statically between the OpenMP
+// threads and run the same fused pass as kmeans_OMP and kmeans_MPI
+// (LloydStep, lloyd_step.h: GEMM or direct assignment, per-thread sums), with
+// the stopping criteria of convergence.h. Of the Options only init, seed,
+// simd, assign, gemm_threshold and the tol_* fields are read. A warm start
+// replaces the seeding by the given centroids: when the data changed little
+// since the model was saved, the loop stops after a few iterations.
+// KMeansPredictor labels new points with a model. kmeans_check.cpp runs
+// fitKMeans and kmeans_OMP from the same warm start and compares their
+// centroids.
+//
+// Header only, like the rest of the code: compile with -fopenmp to use the
+// threads, without it the same code runs on one thread.
+
+#ifndef KMEANS_LIB_H
+#define KMEANS_LIB_H
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "convergence.h"
+#include "distance.h"
+#include "kmeans_model.h"
+#include "lloyd_step.h"
+#include "options.h"
+#include "point_matrix.h"
+#include "seeding.h"
+
+// total_points rows of total_values coordinates, not owned
+struct DataView
+{
+    const double *values = nullptr;
+    int total_points = 0, total_values = 0;
+    std::size_t stride = 0; // doubles from the start of a row to the next
+
+    DataView() {}
+
+    // stride 0 means contiguous rows (stride = total_values)
+    DataView(const double *values, int total_points, int total_values, std::size_t stride = 0)
+    {
+        this->values = values;
+        this->total_points = total_points;
+        this->total_values = total_values;
+        this->stride = stride > 0 ? stride : total_values;
+    }
+
+    const double *getRow(int index) const
+    {
+        return values + (std::size_t)index * stride;
+    }
+};
+
+struct KMeansResult
+{
+    KMeansModel model;       // final centroids, iterations and inertia of the last assignment
+    std::vector<int> labels; // cluster of every point in the last assignment
+    bool converged = false;  // false when max_iterations ended the loop
+    std::string reason;      // criterion that ended the loop (convergence.h)
+};
+
+// clusters the rows of data into K clusters; warm_start, when given, must
+// have the same K and total_values. Returns false (with a message on
+// stderr) when the arguments are not valid.
+inline bool fitKMeans(const DataView &data, int K, int max_iterations, KMeansResult &result,
+                      const Options &options = Options(), const KMeansModel *warm_start = nullptr)
+{
+    int total_points = data.total_points, total_values = data.total_values;
+
+    if (K <= 0 || K > total_points || total_values <= 0 || data.stride < (std::size_t)total_values)
+    {
+        std::cerr << "fitKMeans: needs 1 <= K <= total_points and stride >= total_values\n";
+        return false;
+    }
+
+    if (warm_start && (warm_start->K != K || warm_start->total_values != total_values))
+    {
+        std::cerr << "fitKMeans: the warm start model has K=" << warm_start->K << " and "
+                  << warm_start->total_values << " values, expected K=" << K << " and " << total_values << "\n";
+        return false;
+    }
+
+    KMeansModel &model = result.model;
+
+    model.K = K;
+    model.total_values = total_values;
+    model.total_points = total_points;
+    model.iterations = 0;
+    model.inertia = 0.0;
+
+    if (warm_start)
+        model.centers = warm_start->centers;
+    else
+    {
+        std::mt19937_64 rng(options.seed < 0 ? 0 : options.seed);
+        std::vector<int> seeds =
+            options.init == "random"
+                ? chooseRandomSeeds(total_points, K, rng)
+                : chooseKMeansPlusPlusSeeds(data.values, data.stride, total_points, total_values, K, rng);
+
+        model.centers.resize((std::size_t)K * total_values);
+
+        for (int i = 0; i < K; i++)
+            std::copy(data.getRow(seeds[i]), data.getRow(seeds[i]) + total_values,
+                      model.centers.begin() + (std::size_t)i * total_values);
+    }
+
+    int total_threads = 1;
+#ifdef _OPENMP
+    total_threads = omp_get_max_threads();
+#endif
+
+    // the same pass as kmeans_OMP and kmeans_MPI
+    LloydStep step(K, total_values, options.assign, options.gemm_threshold, parseSimdLevel(options.simd),
+                   total_threads);
+    // the inertia and the shift are always measured, for the model
+    ConvergenceCheck convergence(options, total_points, K, total_values, true);
+
+    // changed points and inertia of every thread, one cache line apart,
+    // added in thread order so the inertia does not depend on which thread
+    // finishes first
+    const int slot_stride = 8;
+    std::vector<long long> thread_changed((std::size_t)total_threads * slot_stride);
+    std::vector<double> thread_inertia((std::size_t)total_threads * slot_stride);
+    int active_threads = 1;
+
+    // strided views are copied one tile at a time, so the kernels always
+    // read contiguous rows
+    bool contiguous = data.stride == (std::size_t)total_values;
+    std::vector<AlignedVector> tile_rows(contiguous ? 0 : total_threads,
+                                         AlignedVector((std::size_t)LloydStep::tile_size * total_values));
+
+    result.labels.assign(total_points, -1);
+    int *labels = result.labels.data();
+
+    for (int i = 0; i < K; i++)
+        convergence.setCenter(i, model.getCenter(i));
+
+    for (int iter = 1;; iter++)
+    {
+        for (int i = 0; i < K; i++)
+            step.setCenter(i, model.getCenter(i));
+
+#pragma omp parallel num_threads(total_threads)
+        {
+            int thread = 0;
+#ifdef _OPENMP
+            thread = omp_get_thread_num();
+#pragma omp single
+            active_threads = omp_get_num_threads();
+#endif
+            int begin = (long long)total_points * thread / active_threads;
+            int end = (long long)total_points * (thread + 1) / active_threads;
+            long long changed = 0;
+            double inertia = 0.0;
+
+            step.clear(thread);
+
+            if (contiguous)
+                changed = step.assignAndAccumulate(data.values, labels, begin, end, thread, true, inertia);
+            else
+            {
+                double *rows = tile_rows[thread].data();
+
+                for (int tile = begin; tile < end; tile += LloydStep::tile_size)
+                {
+                    int count = std::min(LloydStep::tile_size, end - tile);
+
+                    for (int i = 0; i < count; i++)
+                        std::copy(data.getRow(tile + i), data.getRow(tile + i) + total_values,
+                                  rows + (std::size_t)i * total_values);
+
+                    changed += step.assignAndAccumulate(rows, labels + tile, 0, count, thread, true, inertia);
+                }
+            }
+
+            thread_changed[thread * slot_stride] = changed;
+            thread_inertia[thread * slot_stride] = inertia;
+
+            step.reduce(thread, active_threads);
+        }
+
+        long long changed = 0;
+        double inertia = 0.0;
+
+        for (int t = 0; t < active_threads; t++)
+        {
+            changed += thread_changed[t * slot_stride];
+            inertia += thread_inertia[t * slot_stride];
+        }
+
+        // an empty cluster keeps its center
+        double max_shift = 0.0;
+
+        for (int i = 0; i < K; i++)
+        {
+            step.centerFromSums(i, &model.centers[(std::size_t)i * total_values]);
+            max_shift = std::max(max_shift, convergence.centerShift(i, model.getCenter(i)));
+        }
+
+        bool converged = convergence.converged(changed, inertia, max_shift);
+
+        if (converged || iter >= max_iterations)
+        {
+            model.iterations = iter;
+            model.inertia = inertia;
+            result.converged = converged;
+            result.reason = converged ? convergence.getReason() : "max_iterations reached";
+            return true;
+        }
+    }
+}
+
+// nearest centroid of new points with a trained model (kmeans_predict.cpp):
+// the centroids are packed once for the SIMD kernel of distance.h and the
+// object is only read afterwards, so several threads can share it
+class KMeansPredictor
+{
+private:
+    int K, total_values;
+    CenterBlocks center_blocks;
+
+public:
+    // batches of at least this many rows are split between the OpenMP
+    // threads; smaller ones are labelled by the calling thread
+    static const int parallel_threshold = 1024;
+
+    KMeansPredictor(const KMeansModel &model = KMeansModel(), SimdLevel level = detectSimdLevel())
+    {
+        K = model.K;
+        total_values = model.total_values;
+        center_blocks = CenterBlocks(K, total_values, level);
+
+        for (int i = 0; i < K; i++)
+            center_blocks.setCenter(i, model.getCenter(i));
+    }
+
+    int getK() const
+    {
+        return K;
+    }
+
+    int getTotalValues() const
+    {
+        return total_values;
+    }
+
+    int predict(const double *point) const
+    {
+        return center_blocks.nearest(point);
+    }
+
+    // labels[i] = nearest centroid of row i of data
+    void predict(const DataView &data, int *labels) const
+    {
+        int total_points = data.total_points;
+
+#pragma omp parallel for schedule(static) if (total_points >= parallel_threshold)
+        for (int i = 0; i < total_points; i++)
+            labels[i] = center_blocks.nearest(data.getRow(i));
+    }
+};
+
+#endif
@@ -0,0 +1,147 @@
+// Trained model (the K centroids of a run) and its binary file format,
+// written with --save-model and read back with --warm-start or by the
+// library API of kmeans_lib.h.
+//
+// Layout of the file (all integers little endian, as written by the host):
+//
+//   [0, 64)   ModelHeader
+//   [64, ...) K * total_values float64 coordinates, row-major (centroid i
+//             occupies [i * total_values, (i + 1) * total_values))
+//
+// The header also records how the model was obtained (number of points,
+// iterations and the final inertia, 0 when the run did not measure it);
+// only K and total_values are needed to use it.
+
+#ifndef KMEANS_MODEL_H
+#define KMEANS_MODEL_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct ModelHeader
+{
+    char magic[8]; // "KMEANSMD"
+    uint32_t version;
+    uint32_t K, total_values;
+    uint32_t iterations;
+    uint64_t total_points;
+    double inertia;
+    uint64_t reserved[3];
+};
+
+static_assert(sizeof(ModelHeader) == 64, "ModelHeader must keep its on-disk size");
+
+static const char MODEL_MAGIC[8] = {'K', 'M', 'E', 'A', 'N', 'S', 'M', 'D'};
+static const uint32_t MODEL_VERSION = 1;
+
+struct KMeansModel
+{
+    int K = 0, total_values = 0;
+    int iterations = 0;
+    long long total_points = 0; // points of the run that produced the model
+    double inertia = 0.0;
+    std::vector<double> centers; // K * total_values, row-major
+
+    const double *getCenter(int id_cluster) const
+    {
+        return centers.data() + (std::size_t)id_cluster * total_values;
+    }
+};
+
+// false (with a message on stderr) when the file cannot be written
+inline bool saveModel(const std::string &path, const KMeansModel &model)
+{
+    FILE *file = fopen(path.c_str(), "wb");
+
+    if (!file)
+    {
+        std::cerr << path << ": cannot write the model file\n";
+        return false;
+    }
+
+    ModelHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MODEL_MAGIC, 8);
+    header.version = MODEL_VERSION;
+    header.K = model.K;
+    header.total_values = model.total_values;
+    header.iterations = model.iterations;
+    header.total_points = model.total_points;
+    header.inertia = model.inertia;
+
+    std::size_t total = (std::size_t)model.K * model.total_values;
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(model.centers.data(), sizeof(double), total, file) == total;
+
+    if (fclose(file) != 0 || !written)
+    {
+        std::cerr << path << ": cannot write the model file\n";
+        return false;
+    }
+
+    return true;
+}
+
+// false (with a message on stderr) when the file is missing, is not a model
+// or is truncated; model is only changed on success
+inline bool loadModel(const std::string &path, KMeansModel &model)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+
+    if (!file)
+    {
+        std::cerr << path << ": cannot open the model file\n";
+        return false;
+    }
+
+    ModelHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, MODEL_MAGIC, 8) == 0 &&
+                 header.version == MODEL_VERSION && header.K > 0 && header.total_values > 0;
+    KMeansModel loaded;
+
+    if (valid)
+    {
+        loaded.K = header.K;
+        loaded.total_values = header.total_values;
+        loaded.iterations = header.iterations;
+        loaded.total_points = header.total_points;
+        loaded.inertia = header.inertia;
+        loaded.centers.resize((std::size_t)loaded.K * loaded.total_values);
+
+        valid = fread(loaded.centers.data(), sizeof(double), loaded.centers.size(), file) == loaded.centers.size();
+    }
+
+    fclose(file);
+
+    if (!valid)
+    {
+        std::cerr << path << ": not a model file or truncated (see --save-model)\n";
+        return false;
+    }
+
+    model = loaded;
+    return true;
+}
+
+// loads the model a run starts from (--warm-start) and checks that it has
+// the K and the dimension of the dataset
+inline bool loadWarmStart(const std::string &path, int K, int total_values, KMeansModel &model)
+{
+    if (!loadModel(path, model))
+        return false;
+
+    if (model.K != K || model.total_values != total_values)
+    {
+        std::cerr << path << ": the model has K=" << model.K << " and " << model.total_values
+                  << " values, the dataset K=" << K << " and " << total_values << " values\n";
+        return false;
+    }
+
+    return true;
+}
+
+#endif
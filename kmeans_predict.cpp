@@ -0,0 +1,646 @@
+// Labels new points with the centroids of a saved model (--save-model of
+// the three versions, see kmeans_model.h), using the SIMD nearest centroid
+// kernel of distance.h and all the OpenMP threads.
+//
+// Points are text lines of total_values numbers (anything after them, like
+// a name, is ignored); every line gets one line with the 0-based index of
+// its nearest centroid, or -1 when it does not have total_values numbers.
+// Blank lines get no answer.
+//
+//  - batch (default): stdin is read in blocks and its complete lines are
+//    labelled --batch at a time, the rows of a batch split between the
+//    threads. With --input the whole dataset file (text with header or
+//    binary, as for the other programs) is labelled in one pass.
+//  - --latency: one line at a time, answered and flushed before the next
+//    one is read.
+//  - --serve PORT: the same line protocol over TCP on 127.0.0.1, one thread
+//    per connection. All the complete lines that have arrived are labelled
+//    as one batch, so a client that pipelines its points gets the
+//    throughput of the batch mode and a client that waits for every answer
+//    gets the latency of a single point.
+//  - --client PORT: stand-in client for benchmarking the server: sends the
+//    points of --input one at a time (--requests round trips, latency
+//    percentiles) and then all of them pipelined in windows of --pipeline
+//    lines (points per second). With --model the answers are checked
+//    against a local prediction.
+//
+// Usage:
+//   kmeans_predict --model centers.model [--threads 4] [--batch 4096] [--latency] < points.txt
+//   kmeans_predict --model centers.model --input dataset.bin > labels.txt
+//   kmeans_predict --model centers.model --serve 5555 [--connections 0]
+//   kmeans_predict --client 5555 --input dataset.bin [--requests 1000] [--pipeline 1024] [--model centers.model]
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include "dataset_file.h"
+#include "kmeans_lib.h"
+#include "kmeans_model.h"
+
+using namespace std;
+
+struct PredictOptions
+{
+    string model = "";
+    string input = "";
+    int threads = 0; // 0 keeps the OpenMP default
+    int batch = 4096; // lines labelled together in batch and server mode
+    bool latency = false;
+    int serve_port = 0;
+    int connections = 0; // server: exit after this many connections (0 = never)
+    int client_port = 0;
+    int requests = 1000; // client: round trips of the latency test
+    int pipeline = 1024; // client: lines sent before reading their answers
+};
+
+PredictOptions parsePredictOptions(int argc, char *argv[])
+{
+    PredictOptions options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--model" && has_value)
+            options.model = argv[++i];
+        else if (arg == "--input" && has_value)
+            options.input = argv[++i];
+        else if (arg == "--threads" && has_value)
+            options.threads = atoi(argv[++i]);
+        else if (arg == "--batch" && has_value)
+            options.batch = max(1, atoi(argv[++i]));
+        else if (arg == "--latency")
+            options.latency = true;
+        else if (arg == "--serve" && has_value)
+            options.serve_port = atoi(argv[++i]);
+        else if (arg == "--connections" && has_value)
+            options.connections = atoi(argv[++i]);
+        else if (arg == "--client" && has_value)
+            options.client_port = atoi(argv[++i]);
+        else if (arg == "--requests" && has_value)
+            options.requests = max(1, atoi(argv[++i]));
+        else if (arg == "--pipeline" && has_value)
+            options.pipeline = max(1, atoi(argv[++i]));
+        else
+            cerr << "Ignoring unknown option " << arg << "\n";
+    }
+
+    return options;
+}
+
+double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// parses total_values numbers of the line [p, end) into row; false when the
+// line has fewer. The numbers are read by the parser of the training
+// programs (text_parser.h), so a file is read the same way in any locale.
+bool parsePoint(const char *p, const char *end, int total_values, double *row)
+{
+    for (int j = 0; j < total_values; j++)
+    {
+        p = skipBlanks(p, end);
+        if (p >= end || !(p = tryParseValue(p, end, row[j])))
+            return false;
+    }
+
+    return true;
+}
+
+bool isBlankLine(const char *p, const char *end)
+{
+    for (; p < end; p++)
+    {
+        if (!isBlank(*p))
+            return false;
+    }
+
+    return true;
+}
+
+// labels the complete lines of a text buffer; the scratch rows and labels
+// are kept between calls, so a connection or a stream does not allocate per
+// batch
+class LineLabeller
+{
+private:
+    const KMeansPredictor &predictor;
+    int batch_size;
+    vector<const char *> line_begin, line_end;
+    AlignedVector rows;
+    vector<int> labels;
+
+    void labelBatch(string &output)
+    {
+        int count = line_begin.size(), total_values = predictor.getTotalValues();
+
+        rows.resize((size_t)count * total_values);
+        labels.resize(count);
+
+        // parsing and distances in the same parallel loop
+#pragma omp parallel for schedule(static) if (count >= KMeansPredictor::parallel_threshold)
+        for (int i = 0; i < count; i++)
+        {
+            double *row = &rows[(size_t)i * total_values];
+
+            labels[i] = parsePoint(line_begin[i], line_end[i], total_values, row) ? predictor.predict(row) : -1;
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            output += to_string(labels[i]);
+            output += '\n';
+        }
+
+        line_begin.clear();
+        line_end.clear();
+    }
+
+public:
+    LineLabeller(const KMeansPredictor &predictor, int batch_size) : predictor(predictor)
+    {
+        this->batch_size = batch_size;
+    }
+
+    // appends the labels of the complete lines of [begin, end) to output and
+    // returns the start of the incomplete last line (end if there is none)
+    const char *label(const char *begin, const char *end, string &output)
+    {
+        const char *p = begin;
+
+        while (true)
+        {
+            const char *newline = static_cast<const char *>(memchr(p, '\n', end - p));
+
+            if (!newline)
+                break;
+
+            if (!isBlankLine(p, newline))
+            {
+                line_begin.push_back(p);
+                line_end.push_back(newline);
+
+                if ((int)line_begin.size() == batch_size)
+                    labelBatch(output);
+            }
+
+            p = newline + 1;
+        }
+
+        if (!line_begin.empty())
+            labelBatch(output);
+
+        return p;
+    }
+};
+
+// --input: labels every point of a dataset file in one parallel pass
+int labelDataset(const PredictOptions &options, const KMeansPredictor &predictor)
+{
+    int K, max_iterations;
+    PointMatrix points = loadDataset(options.input, K, max_iterations);
+    int total_points = points.getTotalPoints();
+
+    if (points.getTotalValues() != predictor.getTotalValues())
+    {
+        cerr << options.input << ": the points have " << points.getTotalValues() << " values, the model "
+             << predictor.getTotalValues() << "\n";
+        return 1;
+    }
+
+    vector<int> labels(total_points);
+    auto start = chrono::steady_clock::now();
+
+    predictor.predict(DataView(points.data(), total_points, points.getTotalValues()), labels.data());
+
+    double elapsed = secondsSince(start);
+    string output;
+
+    for (int i = 0; i < total_points; i++)
+    {
+        output += to_string(labels[i]);
+        output += '\n';
+    }
+    fwrite(output.data(), 1, output.size(), stdout);
+
+    cerr << "Labelled " << total_points << " points in " << elapsed << " seconds ("
+         << (elapsed > 0.0 ? total_points / elapsed : 0.0) << " points/s)\n";
+    return 0;
+}
+
+// stdin, batch mode: blocks of 1 MB, the incomplete last line of a block is
+// carried over to the next one
+int labelStream(const PredictOptions &options, const KMeansPredictor &predictor)
+{
+    const size_t block_size = 1 << 20;
+    LineLabeller labeller(predictor, options.batch);
+    vector<char> buffer;
+    size_t used = 0, read;
+    string output;
+
+    do
+    {
+        buffer.resize(used + block_size + 1);
+        read = fread(buffer.data() + used, 1, block_size, stdin);
+        used += read;
+
+        // the last line of the input may have no '\n'
+        if (read == 0 && used > 0 && buffer[used - 1] != '\n')
+            buffer[used++] = '\n';
+
+        const char *rest = labeller.label(buffer.data(), buffer.data() + used, output);
+        size_t consumed = rest - buffer.data();
+
+        memmove(buffer.data(), rest, used - consumed);
+        used -= consumed;
+
+        fwrite(output.data(), 1, output.size(), stdout);
+        output.clear();
+    } while (read > 0);
+
+    fflush(stdout);
+    return 0;
+}
+
+// stdin, --latency: every line is answered before the next one is read
+int labelLines(const KMeansPredictor &predictor)
+{
+    int total_values = predictor.getTotalValues();
+    AlignedVector row(total_values);
+    vector<char> line(4096);
+
+    while (fgets(line.data(), line.size(), stdin))
+    {
+        size_t length = strlen(line.data());
+
+        // a line longer than the buffer: grow it and read the rest
+        while (length == line.size() - 1 && line[length - 1] != '\n')
+        {
+            line.resize(line.size() * 2);
+            if (!fgets(line.data() + length, line.size() - length, stdin))
+                break;
+            length += strlen(line.data() + length);
+        }
+
+        const char *end = line.data() + length;
+
+        if (isBlankLine(line.data(), end))
+            continue;
+
+        int label = parsePoint(line.data(), end, total_values, row.data()) ? predictor.predict(row.data()) : -1;
+
+        printf("%d\n", label);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+#ifndef _WIN32
+
+bool sendAll(int socket, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+
+        if (sent <= 0)
+            return false;
+        data += sent;
+        size -= sent;
+    }
+
+    return true;
+}
+
+void setNoDelay(int socket)
+{
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// one connection of the server: everything received up to the last '\n' is
+// labelled as one batch and answered with one send
+void serveConnection(int socket, const KMeansPredictor &predictor, int batch_size)
+{
+    LineLabeller labeller(predictor, batch_size);
+    vector<char> buffer(1 << 16);
+    size_t used = 0;
+    string output;
+
+    setNoDelay(socket);
+
+    while (true)
+    {
+        if (buffer.size() - used < 4096)
+            buffer.resize(buffer.size() * 2);
+
+        ssize_t received = recv(socket, buffer.data() + used, buffer.size() - used, 0);
+
+        if (received <= 0)
+            break;
+        used += received;
+
+        const char *rest = labeller.label(buffer.data(), buffer.data() + used, output);
+        size_t consumed = rest - buffer.data();
+
+        memmove(buffer.data(), rest, used - consumed);
+        used -= consumed;
+
+        if (!output.empty() && !sendAll(socket, output.data(), output.size()))
+            break;
+        output.clear();
+    }
+
+    close(socket);
+}
+
+int serve(const PredictOptions &options, const KMeansPredictor &predictor)
+{
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    sockaddr_in address;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.serve_port);
+
+    if (server >= 0)
+        setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (server < 0 || bind(server, (sockaddr *)&address, sizeof(address)) != 0 || listen(server, 64) != 0)
+    {
+        cerr << "cannot listen on 127.0.0.1:" << options.serve_port << "\n";
+        return 1;
+    }
+
+    cerr << "Serving " << predictor.getK() << " centroids of " << predictor.getTotalValues()
+         << " values on 127.0.0.1:" << options.serve_port << "\n";
+
+    // the connection threads are detached, so a server that runs forever
+    // keeps nothing of the connections that ended; they are only counted,
+    // and serve waits for the count to reach 0 before it returns
+    mutex active_mutex;
+    condition_variable connection_ended;
+    int active = 0;
+
+    for (int served = 0; options.connections == 0 || served < options.connections; served++)
+    {
+        int connection = accept(server, NULL, NULL);
+
+        if (connection < 0)
+            break;
+
+        {
+            lock_guard<mutex> lock(active_mutex);
+            active++;
+        }
+
+        thread([&, connection]
+        {
+            serveConnection(connection, predictor, options.batch);
+
+            lock_guard<mutex> lock(active_mutex);
+            if (--active == 0)
+                connection_ended.notify_all();
+        }).detach();
+    }
+
+    close(server);
+
+    unique_lock<mutex> lock(active_mutex);
+    connection_ended.wait(lock, [&] { return active == 0; });
+    return 0;
+}
+
+// reads answers until count lines have arrived; pending keeps the bytes
+// after the last complete line
+bool receiveLines(int socket, int count, vector<int> &labels, string &pending)
+{
+    char buffer[1 << 16];
+
+    labels.clear();
+
+    while (true)
+    {
+        size_t begin = 0, newline;
+
+        while ((int)labels.size() < count && (newline = pending.find('\n', begin)) != string::npos)
+        {
+            labels.push_back(atoi(pending.c_str() + begin));
+            begin = newline + 1;
+        }
+        pending.erase(0, begin);
+
+        if ((int)labels.size() == count)
+            return true;
+
+        ssize_t received = recv(socket, buffer, sizeof(buffer), 0);
+
+        if (received <= 0)
+            return false;
+        pending.append(buffer, received);
+    }
+}
+
+double percentile(vector<double> values, double fraction)
+{
+    if (values.empty())
+        return 0.0;
+
+    sort(values.begin(), values.end());
+    return values[min(values.size() - 1, (size_t)(fraction * values.size()))];
+}
+
+// --client: latency of single round trips, then throughput of pipelined
+// windows, against a server on 127.0.0.1
+int runClient(const PredictOptions &options)
+{
+    int K, max_iterations;
+    PointMatrix points = loadDataset(options.input, K, max_iterations);
+    int total_points = points.getTotalPoints(), total_values = points.getTotalValues();
+
+    if (total_points == 0)
+    {
+        cerr << options.input << ": no points\n";
+        return 1;
+    }
+
+    // with --model the answers are compared with a local prediction
+    KMeansModel model;
+    vector<int> expected;
+
+    if (!options.model.empty())
+    {
+        if (!loadModel(options.model, model))
+            return 1;
+        if (model.total_values != total_values)
+        {
+            cerr << options.model << ": the model has " << model.total_values << " values, the points "
+                 << total_values << "\n";
+            return 1;
+        }
+
+        expected.resize(total_points);
+        KMeansPredictor(model).predict(DataView(points.data(), total_points, total_values), expected.data());
+    }
+
+    vector<string> lines(total_points);
+    char number[32];
+
+    for (int i = 0; i < total_points; i++)
+    {
+        for (int j = 0; j < total_values; j++)
+        {
+            snprintf(number, sizeof(number), j + 1 < total_values ? "%.17g " : "%.17g\n", points.getValue(i, j));
+            lines[i] += number;
+        }
+    }
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(options.client_port);
+
+    if (client < 0 || connect(client, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        cerr << "cannot connect to 127.0.0.1:" << options.client_port << "\n";
+        return 1;
+    }
+
+    setNoDelay(client);
+
+    vector<int> labels;
+    vector<double> round_trips;
+    string pending;
+    long long mismatches = 0;
+
+    for (int r = 0; r < options.requests; r++)
+    {
+        int i = r % total_points;
+        auto start = chrono::steady_clock::now();
+
+        if (!sendAll(client, lines[i].data(), lines[i].size()) || !receiveLines(client, 1, labels, pending))
+        {
+            cerr << "connection lost\n";
+            return 1;
+        }
+
+        round_trips.push_back(secondsSince(start) * 1e6);
+        if (!expected.empty())
+            mismatches += labels[0] != expected[i];
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    for (int first = 0; first < total_points; first += options.pipeline)
+    {
+        int count = min(options.pipeline, total_points - first);
+        string window;
+
+        for (int i = first; i < first + count; i++)
+            window += lines[i];
+
+        if (!sendAll(client, window.data(), window.size()) || !receiveLines(client, count, labels, pending))
+        {
+            cerr << "connection lost\n";
+            return 1;
+        }
+
+        for (int i = 0; i < count && !expected.empty(); i++)
+            mismatches += labels[i] != expected[first + i];
+    }
+
+    double elapsed = secondsSince(start);
+    close(client);
+
+    cout << "Latency (" << options.requests << " round trips, us): p50=" << percentile(round_trips, 0.5)
+         << " p90=" << percentile(round_trips, 0.9) << " p99=" << percentile(round_trips, 0.99) << "\n";
+    cout << "Throughput (windows of " << options.pipeline << "): " << (elapsed > 0.0 ? total_points / elapsed : 0.0)
+         << " points/s\n";
+    if (!expected.empty())
+        cout << "Mismatches with the local prediction: " << mismatches << "\n";
+
+    return mismatches == 0 ? 0 : 1;
+}
+
+#endif
+
+int main(int argc, char *argv[])
+{
+    PredictOptions options = parsePredictOptions(argc, argv);
+
+#ifdef _OPENMP
+    if (options.threads > 0)
+        omp_set_num_threads(options.threads);
+#endif
+
+    if (options.client_port > 0)
+    {
+#ifndef _WIN32
+        if (options.input.empty())
+        {
+            cerr << "Usage: " << argv[0] << " --client PORT --input dataset [--model centers.model]\n";
+            return 1;
+        }
+        return runClient(options);
+#else
+        cerr << "--client needs POSIX sockets\n";
+        return 1;
+#endif
+    }
+
+    KMeansModel model;
+
+    if (options.model.empty())
+    {
+        cerr << "Usage: " << argv[0] << " --model centers.model [--input dataset | --latency | --serve PORT]\n";
+        return 1;
+    }
+    if (!loadModel(options.model, model))
+        return 1;
+
+    KMeansPredictor predictor(model);
+
+    if (options.serve_port > 0)
+    {
+#ifndef _WIN32
+        return serve(options, predictor);
+#else
+        cerr << "--serve needs POSIX sockets\n";
+        return 1;
+#endif
+    }
+
+    if (!options.input.empty())
+        return labelDataset(options, predictor);
+
+    return options.latency ? labelLines(predictor) : labelStream(options, predictor);
+}
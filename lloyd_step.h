@@ -0,0 +1,206 @@
+// The fused assignment and accumulation pass of a Lloyd iteration, shared by
+// kmeans_OMP, kmeans_MPI and fitKMeans (kmeans_lib.h).
+//
+// Every thread takes a range of rows and walks it in tiles of tile_size
+// points: the tile is labelled (with the GEMM engine of gemm_assign.h, or
+// with the direct kernel of distance.h, the centroids taken in tiles of
+// blocks that stay in L1) and then added to the private sums of the thread
+// (partial_sums.h) while its rows are still in cache. After the pass the
+// sums are combined with the tree reduction of PartialSums and every
+// centroid is the mean of its points; an empty cluster keeps its center.
+//
+// The callers own the loop around it: the parallel region, the split of
+// the rows between the threads, the Hamerly bounds (which label the points
+// one by one and only use accumulateTile) and the convergence check.
+
+#ifndef LLOYD_STEP_H
+#define LLOYD_STEP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <string>
+
+#include "accumulate.h"
+#include "distance.h"
+#include "gemm_assign.h"
+#include "partial_sums.h"
+#include "point_matrix.h"
+#include "seeding.h"
+
+class LloydStep
+{
+private:
+    int K, total_values;
+    CenterBlocks center_blocks;
+    int center_tile_blocks;    // centroid blocks compared with a tile of points at a time
+    GemmAssigner gemm;         // blocked GEMM assignment for large K * D (gemm_assign.h)
+    bool use_gemm;
+    AccumulateKernel accumulate; // fixed-dimension accumulation loop (accumulate.h)
+    PartialSums partial_sums;    // per-thread sums and counts
+    AlignedVector centers;       // K * total_values, for the distances of the GEMM path
+
+public:
+    // points labelled between two accumulations
+    static const int tile_size = PartialSums::tile_size;
+
+    // assign and gemm_threshold as in --assign and --gemm-threshold;
+    // total_threads is the number of threads of the passes
+    LloydStep(int K = 0, int total_values = 0, const std::string &assign = "auto", long long gemm_threshold = 4096,
+              SimdLevel level = detectSimdLevel(), int total_threads = 1)
+    {
+        this->K = K;
+        this->total_values = total_values;
+
+        center_blocks = CenterBlocks(K, total_values, level);
+        // half of a 32 KB L1 for the centroids, the rest for the point rows
+        center_tile_blocks = center_blocks.blocksPerTile(16 * 1024);
+
+        use_gemm = useGemmAssignment(assign, K, total_values, gemm_threshold);
+        if (use_gemm)
+            gemm = GemmAssigner(K, total_values, level, total_threads);
+
+        accumulate = selectAccumulateKernel(total_values);
+        partial_sums = PartialSums(K, total_values, total_threads);
+        centers.resize((std::size_t)K * total_values);
+    }
+
+    bool usesGemm() const
+    {
+        return use_gemm;
+    }
+
+    // copies centroid i into the blocks read by the assignment kernels
+    void setCenter(int i, const double *values)
+    {
+        center_blocks.setCenter(i, values);
+        std::copy(values, values + total_values, &centers[(std::size_t)i * total_values]);
+
+        if (use_gemm)
+            gemm.setCenter(i, values);
+    }
+
+    int nearest(const double *row) const
+    {
+        return center_blocks.nearest(row);
+    }
+
+    PartialSums &getPartialSums()
+    {
+        return partial_sums;
+    }
+
+    // labels the rows [tile, tile_end) of the row-major buffer rows into
+    // labels[0, tile_end - tile), with their squared distances in distances
+    // unless the GEMM engine is used (it does not measure them). Ties keep
+    // the lowest index, as in nearest().
+    void assignTile(const double *rows, int tile, int tile_end, int *labels, double *distances, int thread) const
+    {
+        if (use_gemm)
+        {
+            for (int sub = tile; sub < tile_end; sub += GemmAssigner::tile_points)
+                gemm.assignTile(rows + (std::size_t)sub * total_values, std::min(GemmAssigner::tile_points, tile_end - sub),
+                                labels + (sub - tile), thread);
+            return;
+        }
+
+        int total_blocks = center_blocks.getTotalBlocks();
+
+        for (int i = tile; i < tile_end; i++)
+            distances[i - tile] = std::numeric_limits<double>::max();
+
+        // every centroid tile is compared with all the rows of the point
+        // tile before the next one is loaded
+        for (int first_block = 0; first_block < total_blocks; first_block += center_tile_blocks)
+        {
+            int count = std::min(center_tile_blocks, total_blocks - first_block);
+
+            for (int i = tile; i < tile_end; i++)
+            {
+                double distance;
+                int id_cluster =
+                    center_blocks.nearestInRange(rows + (std::size_t)i * total_values, first_block, count, &distance);
+
+                if (distance < distances[i - tile])
+                {
+                    distances[i - tile] = distance;
+                    labels[i - tile] = id_cluster;
+                }
+            }
+        }
+    }
+
+    // adds the rows [tile, tile_end) to the sums of their labels
+    void accumulateTile(const double *rows, const int *labels, int tile, int tile_end, int thread)
+    {
+        accumulate(rows, labels, tile, tile_end, total_values, partial_sums.getSums(thread),
+                   partial_sums.getCounts(thread));
+    }
+
+    // the fused pass over the rows [begin, end) of rows: labels[i] gets the
+    // nearest centroid of row i and the row goes to the sums of the thread.
+    // Returns the number of labels that changed; with measure_inertia the
+    // squared distances are added to inertia, in row order.
+    long long assignAndAccumulate(const double *rows, int *labels, int begin, int end, int thread,
+                                  bool measure_inertia, double &inertia)
+    {
+        long long changed = 0;
+        int tile_labels[tile_size];
+        double tile_distances[tile_size];
+
+        for (int tile = begin; tile < end; tile += tile_size)
+        {
+            int tile_end = std::min(tile + tile_size, end);
+
+            assignTile(rows, tile, tile_end, tile_labels, tile_distances, thread);
+
+            for (int i = tile; i < tile_end; i++)
+            {
+                int id_nearest_center = tile_labels[i - tile];
+
+                if (labels[i] != id_nearest_center)
+                    changed++;
+                labels[i] = id_nearest_center;
+
+                if (measure_inertia)
+                    inertia += use_gemm ? squaredDistance(rows + (std::size_t)i * total_values,
+                                                          &centers[(std::size_t)id_nearest_center * total_values],
+                                                          total_values)
+                                        : tile_distances[i - tile];
+            }
+
+            accumulateTile(rows, labels, tile, tile_end, thread);
+        }
+
+        return changed;
+    }
+
+    void clear(int thread)
+    {
+        partial_sums.clear(thread);
+    }
+
+    // called by every thread of the parallel region (see PartialSums::reduce)
+    void reduce(int thread, int active_threads)
+    {
+        partial_sums.reduce(thread, active_threads);
+    }
+
+    // after reduce: writes the mean of the points of cluster i to center,
+    // unless it has none, and returns their number
+    int centerFromSums(int i, double *center)
+    {
+        const double *sums = partial_sums.getSums(0) + (std::size_t)i * total_values;
+        int count = partial_sums.getCounts(0)[i];
+
+        if (count > 0)
+        {
+            for (int j = 0; j < total_values; j++)
+                center[j] = sums[j] / count;
+        }
+
+        return count;
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+// Mini-batch k-means (Sculley, "Web-scale k-means clustering").
+//
+// Each step draws batch_size point indexes at random, assigns those points
+// to the nearest center and moves every center towards its points with a
+// per-center learning rate of 1 / (number of points the center has received
+// so far). The batch is only a list of indexes: the points are read in place
+// from the PointMatrix, nothing is copied or shuffled, so with a memory
+// mapped dataset only the pages of the sampled rows are touched.
+
+#ifndef MINIBATCH_H
+#define MINIBATCH_H
+
+#include <cstddef>
+#include <random>
+#include <vector>
+
+#include "distance.h"
+#include "point_matrix.h"
+
+class MiniBatch
+{
+private:
+    int K, total_values;
+    SimdLevel level;
+    std::vector<double> centers;          // K * total_values, row-major
+    std::vector<long long> center_counts; // points received by each center
+
+public:
+    MiniBatch(int K, int total_values, SimdLevel level = detectSimdLevel())
+    {
+        this->K = K;
+        this->total_values = total_values;
+        this->level = level;
+
+        centers.assign((std::size_t)K * total_values, 0.0);
+        center_counts.assign(K, 0);
+    }
+
+    void setCenter(int id_cluster, const double *values)
+    {
+        for (int j = 0; j < total_values; j++)
+            centers[(std::size_t)id_cluster * total_values + j] = values[j];
+    }
+
+    const double *getCenter(int id_cluster) const
+    {
+        return &centers[(std::size_t)id_cluster * total_values];
+    }
+
+    // runs the given number of mini-batch steps over the points [begin, end)
+    void run(const PointMatrix &points, int begin, int end, int batch_size, int iterations, unsigned long long seed)
+    {
+        std::mt19937_64 rng(seed);
+        std::uniform_int_distribution<int> pick(begin, end - 1);
+        std::vector<int> batch(batch_size), labels(batch_size);
+        CenterBlocks blocks(K, total_values, level);
+
+        for (int t = 0; t < iterations; t++)
+        {
+            for (int b = 0; b < batch_size; b++)
+                batch[b] = pick(rng);
+
+            for (int i = 0; i < K; i++)
+                blocks.setCenter(i, getCenter(i));
+
+            // the assignment of the batch is independent per point
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+            for (int b = 0; b < batch_size; b++)
+                labels[b] = blocks.nearest(points.getRow(batch[b]));
+
+            // the gradient step is sequential: each point moves its center
+            // with the learning rate of that center at that moment
+            for (int b = 0; b < batch_size; b++)
+            {
+                int id_cluster = labels[b];
+                const double *values = points.getRow(batch[b]);
+                double *center = &centers[(std::size_t)id_cluster * total_values];
+                double eta = 1.0 / ++center_counts[id_cluster];
+
+                for (int j = 0; j < total_values; j++)
+                    center[j] += eta * (values[j] - center[j]);
+            }
+        }
+    }
+};
+
+#endif
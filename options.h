@@ -0,0 +1,226 @@
+// Command line options shared by the serial, OpenMP and MPI versions.
+//
+// The first positional argument keeps its original meaning (number of
+// threads in kmeans_OMP and kmeans_MPI); the optional features are enabled
+// with "--name value" or "--flag" arguments after it.
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// --precision (OpenMP version): coordinates and distances in double or float
+enum Precision
+{
+    PRECISION_DOUBLE,
+    PRECISION_FLOAT
+};
+
+// --float-sums: centroid sums of the float path in double or in float with
+// Kahan compensation
+enum FloatSums
+{
+    FLOAT_SUMS_DOUBLE,
+    FLOAT_SUMS_KAHAN
+};
+
+inline const char *precisionName(Precision precision)
+{
+    return precision == PRECISION_FLOAT ? "float" : "double";
+}
+
+inline const char *floatSumsName(FloatSums float_sums)
+{
+    return float_sums == FLOAT_SUMS_KAHAN ? "kahan" : "double";
+}
+
+struct Options
+{
+    int num_threads = 1;
+
+    // dataset file (binary or text, see dataset_file.h); empty reads stdin
+    std::string input = "";
+
+    // distance kernel: auto, scalar, avx2 or avx512 (see distance.h)
+    std::string simd = "auto";
+
+    // OpenMP version: PRECISION_FLOAT stores the points and computes the
+    // distances in single precision; the centroid sums are kept in double or
+    // in float with Kahan compensation
+    Precision precision = PRECISION_DOUBLE;
+    FloatSums float_sums = FLOAT_SUMS_DOUBLE;
+    bool validate_precision = false; // compare the labels with a double run
+
+    // initial centers: random, kmeans++ (serial/OpenMP default) or
+    // kmeans|| (MPI default); seed < 0 keeps the per-version default seed
+    std::string init = "";
+    long long seed = -1;
+
+    // assignment engine: auto, direct or gemm (gemm_assign.h); auto uses
+    // the GEMM engine when K * total_values >= gemm_threshold and
+    // total_values >= 8 (see useGemmAssignment for the measurements)
+    std::string assign = "auto";
+    long long gemm_threshold = 4096;
+
+    // OpenMP version: "static" splits the points evenly between the threads,
+    // "steal" hands them out in chunks of grain points with work stealing
+    // (work_stealing.h)
+    std::string scheduler = "static";
+    int grain = 1024;
+
+    // early stopping (convergence.h), 0 disables a criterion: largest center
+    // shift, relative inertia improvement, fraction of changed points
+    double tol_shift = 0.0;
+    double tol_inertia = 0.0;
+    double tol_changed = 0.0;
+
+    // Hamerly bounds in the assignment step (hamerly.h)
+    bool hamerly = false;
+
+    // mini-batch k-means (serial and OpenMP versions, minibatch.h)
+    int minibatch_size = 0; // 0 keeps the full Lloyd iterations
+    int minibatch_iterations = 100;
+    bool final_pass = false; // label every point with the final centers
+
+    // MPI version: reduce the centroids in blocks with MPI_Iallreduce,
+    // overlapping the reduction of a block with the accumulation of the next
+    bool overlap = false;
+    int overlap_blocks = 4;
+
+    // print the time of every phase on one line (phase_times.h)
+    bool phase_times = false;
+
+    // per-iteration trace file (instrumentation.h, needs -DKMEANS_TRACE)
+    std::string trace = "";
+
+    // binary model files (kmeans_model.h): the final centroids are written
+    // to save_model, and a run starts from the centroids of warm_start
+    // instead of choosing seeds
+    std::string save_model = "";
+    std::string warm_start = "";
+
+    // OpenMP version: stream a binary --input from disk in chunks of
+    // chunk_points rows on every pass instead of loading it (chunk_stream.h)
+    bool out_of_core = false;
+    int chunk_points = 1 << 16;
+
+    // incremental centroid update (serial version)
+    bool incremental = false;
+    int full_recompute_interval = 10; // full recomputation every N iterations
+};
+
+// an option that takes one of a fixed set of names; an unknown name stops
+// the program instead of falling back to the default
+inline void invalidOptionValue(const std::string &arg, const char *value, const char *accepted)
+{
+    std::cerr << "Invalid value \"" << value << "\" for " << arg << " (expected " << accepted << ")\n";
+    exit(1);
+}
+
+inline Options parseOptions(int argc, char *argv[])
+{
+    Options options;
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg.compare(0, 2, "--") != 0)
+            options.num_threads = atoi(argv[i]);
+        else if (arg == "--input" && has_value)
+            options.input = argv[++i];
+        else if (arg == "--simd" && has_value)
+            options.simd = argv[++i];
+        else if (arg == "--precision" && has_value)
+        {
+            const char *value = argv[++i];
+
+            if (strcmp(value, "double") == 0)
+                options.precision = PRECISION_DOUBLE;
+            else if (strcmp(value, "float") == 0)
+                options.precision = PRECISION_FLOAT;
+            else
+                invalidOptionValue(arg, value, "double or float");
+        }
+        else if (arg == "--float-sums" && has_value)
+        {
+            const char *value = argv[++i];
+
+            if (strcmp(value, "double") == 0)
+                options.float_sums = FLOAT_SUMS_DOUBLE;
+            else if (strcmp(value, "kahan") == 0)
+                options.float_sums = FLOAT_SUMS_KAHAN;
+            else
+                invalidOptionValue(arg, value, "double or kahan");
+        }
+        else if (arg == "--validate-precision")
+            options.validate_precision = true;
+        else if (arg == "--init" && has_value)
+            options.init = argv[++i];
+        else if (arg == "--seed" && has_value)
+            options.seed = atoll(argv[++i]);
+        else if (arg == "--assign" && has_value)
+            options.assign = argv[++i];
+        else if (arg == "--gemm-threshold" && has_value)
+            options.gemm_threshold = atoll(argv[++i]);
+        else if (arg == "--scheduler" && has_value)
+            options.scheduler = argv[++i];
+        else if (arg == "--grain" && has_value)
+            options.grain = atoi(argv[++i]);
+        else if (arg == "--tol-shift" && has_value)
+            options.tol_shift = atof(argv[++i]);
+        else if (arg == "--tol-inertia" && has_value)
+            options.tol_inertia = atof(argv[++i]);
+        else if (arg == "--tol-changed" && has_value)
+            options.tol_changed = atof(argv[++i]);
+        else if (arg == "--hamerly")
+            options.hamerly = true;
+        else if (arg == "--minibatch" && has_value)
+            options.minibatch_size = atoi(argv[++i]);
+        else if (arg == "--minibatch-iterations" && has_value)
+            options.minibatch_iterations = atoi(argv[++i]);
+        else if (arg == "--final-pass")
+            options.final_pass = true;
+        else if (arg == "--overlap")
+            options.overlap = true;
+        else if (arg == "--overlap-blocks" && has_value)
+            options.overlap_blocks = atoi(argv[++i]);
+        else if (arg == "--phase-times")
+            options.phase_times = true;
+        else if (arg == "--trace" && has_value)
+            options.trace = argv[++i];
+        else if (arg == "--save-model" && has_value)
+            options.save_model = argv[++i];
+        else if (arg == "--warm-start" && has_value)
+            options.warm_start = argv[++i];
+        else if (arg == "--out-of-core")
+            options.out_of_core = true;
+        else if (arg == "--chunk-points" && has_value)
+            options.chunk_points = atoi(argv[++i]);
+        else if (arg == "--incremental")
+            options.incremental = true;
+        else if (arg == "--full-recompute" && has_value)
+            options.full_recompute_interval = atoi(argv[++i]);
+        else
+            std::cerr << "Ignoring unknown option " << arg << "\n";
+    }
+
+    if (options.num_threads < 1)
+        options.num_threads = 1;
+    if (options.grain < 1)
+        options.grain = 1;
+    if (options.overlap_blocks < 1)
+        options.overlap_blocks = 1;
+    if (options.chunk_points < 1)
+        options.chunk_points = 1;
+    if (options.full_recompute_interval < 1)
+        options.full_recompute_interval = 1;
+
+    return options;
+}
+
+#endif
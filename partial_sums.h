@@ -0,0 +1,187 @@
+// Per-thread centroid accumulators for the fused assignment pass.
+//
+// Every thread owns a private K * total_values block of sums and K counts,
+// allocated separately and aligned to a cache line, so threads never write
+// to the same line. The assignment loop labels a tile of its points and adds
+// them to its block right away, while the rows are still in cache; then the
+// blocks are combined with a pairwise tree reduction inside the same
+// parallel region (log2(threads) steps, each one done by half of the
+// remaining threads). The result is left in the block of thread 0.
+//
+// The work per thread is the same for any K: there is no loop over the
+// clusters to parallelize.
+
+#ifndef PARTIAL_SUMS_H
+#define PARTIAL_SUMS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "point_matrix.h"
+
+class PartialSums
+{
+private:
+    int K, total_values, total_threads;
+    std::vector<AlignedVector> sums;
+    std::vector<AlignedIntVector> counts;
+
+public:
+    // points labelled between two accumulations of the fused pass
+    static const int tile_size = 256;
+
+    PartialSums(int K = 0, int total_values = 0, int total_threads = 1)
+    {
+        this->K = K;
+        this->total_values = total_values;
+        this->total_threads = total_threads;
+
+        sums.resize(total_threads);
+        counts.resize(total_threads);
+
+        // not filled here: clear() is the first write, done by the owner
+        // thread, so each block is placed on the NUMA node of its thread
+        for (int t = 0; t < total_threads; t++)
+        {
+            sums[t].resize((std::size_t)K * total_values);
+            counts[t].resize(K);
+        }
+    }
+
+    int getTotalThreads() const
+    {
+        return total_threads;
+    }
+
+    double *getSums(int thread)
+    {
+        return sums[thread].data();
+    }
+
+    int *getCounts(int thread)
+    {
+        return counts[thread].data();
+    }
+
+    void clear(int thread)
+    {
+        std::fill(sums[thread].begin(), sums[thread].end(), 0.0);
+        std::fill(counts[thread].begin(), counts[thread].end(), 0);
+    }
+
+    // called by every thread of the parallel region (it contains barriers);
+    // the totals end up in getSums(0) and getCounts(0)
+    void reduce(int thread, int active_threads)
+    {
+        for (int step = 1; step < active_threads; step *= 2)
+        {
+#pragma omp barrier
+            if (thread % (2 * step) == 0 && thread + step < active_threads)
+            {
+                double *target = sums[thread].data();
+                const double *source = sums[thread + step].data();
+                std::size_t total = (std::size_t)K * total_values;
+
+                for (std::size_t v = 0; v < total; v++)
+                    target[v] += source[v];
+
+                for (int c = 0; c < K; c++)
+                    counts[thread][c] += counts[thread + step][c];
+            }
+        }
+#pragma omp barrier
+    }
+};
+
+// float version of PartialSums for --precision float --float-sums kahan:
+// every thread keeps Kahan compensated float sums, and the reduction adds
+// the corrected value (sum - compensation) of the other block with another
+// compensated addition
+class KahanPartialSums
+{
+private:
+    int K, total_values, total_threads;
+    std::vector<std::vector<float, AlignedAllocator<float>>> sums, compensation;
+    std::vector<AlignedIntVector> counts;
+
+public:
+    KahanPartialSums(int K = 0, int total_values = 0, int total_threads = 1)
+    {
+        this->K = K;
+        this->total_values = total_values;
+        this->total_threads = total_threads;
+
+        sums.resize(total_threads);
+        compensation.resize(total_threads);
+        counts.resize(total_threads);
+
+        for (int t = 0; t < total_threads; t++)
+        {
+            sums[t].resize((std::size_t)K * total_values);
+            compensation[t].resize((std::size_t)K * total_values);
+            counts[t].resize(K);
+        }
+    }
+
+    float *getSums(int thread)
+    {
+        return sums[thread].data();
+    }
+
+    float *getCompensation(int thread)
+    {
+        return compensation[thread].data();
+    }
+
+    int *getCounts(int thread)
+    {
+        return counts[thread].data();
+    }
+
+    void clear(int thread)
+    {
+        std::fill(sums[thread].begin(), sums[thread].end(), 0.0f);
+        std::fill(compensation[thread].begin(), compensation[thread].end(), 0.0f);
+        std::fill(counts[thread].begin(), counts[thread].end(), 0);
+    }
+
+    // same contract as PartialSums::reduce
+    void reduce(int thread, int active_threads)
+    {
+        for (int step = 1; step < active_threads; step *= 2)
+        {
+#pragma omp barrier
+            if (thread % (2 * step) == 0 && thread + step < active_threads)
+            {
+                float *sum = sums[thread].data(), *lost = compensation[thread].data();
+                const float *source = sums[thread + step].data(), *source_lost = compensation[thread + step].data();
+                std::size_t total = (std::size_t)K * total_values;
+
+                for (std::size_t v = 0; v < total; v++)
+                {
+                    float y = (source[v] - source_lost[v]) - lost[v];
+                    float t = sum[v] + y;
+
+                    lost[v] = (t - sum[v]) - y;
+                    sum[v] = t;
+                }
+
+                for (int c = 0; c < K; c++)
+                    counts[thread][c] += counts[thread + step][c];
+            }
+        }
+#pragma omp barrier
+    }
+
+    // corrected totals of the reduction, widened to double
+    void getTotals(double *totals) const
+    {
+        std::size_t total = (std::size_t)K * total_values;
+
+        for (std::size_t v = 0; v < total; v++)
+            totals[v] = (double)sums[0][v] - (double)compensation[0][v];
+    }
+};
+
+#endif
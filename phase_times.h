@@ -0,0 +1,54 @@
+// Wall-clock time of every phase of a run, printed with --phase-times as a
+// single "Phase times:" line (the format kmeans_bench parses).
+//
+// The phases are measured by one thread (thread 0, rank 0), so with several
+// threads a phase also includes the time spent waiting for the slowest one
+// at the barrier that ends it.
+
+#ifndef PHASE_TIMES_H
+#define PHASE_TIMES_H
+
+#include <chrono>
+#include <iostream>
+
+struct PhaseTimes
+{
+    double load = 0.0;        // reading (MPI: and distributing) the dataset
+    double seed = 0.0;        // setup and choice of the initial centers
+    double assign = 0.0;      // assignment and accumulation of the sums
+    double update = 0.0;      // new centers from the sums
+    double communicate = 0.0; // MPI reductions between the ranks
+    double total = 0.0;       // whole run, as in the "Tempo de execução" line
+    int iterations = 0;
+};
+
+// seconds since the previous lap (or since construction)
+class PhaseClock
+{
+private:
+    std::chrono::steady_clock::time_point last;
+
+public:
+    PhaseClock()
+    {
+        last = std::chrono::steady_clock::now();
+    }
+
+    double lap()
+    {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - last;
+
+        last = now;
+        return elapsed.count();
+    }
+};
+
+inline void printPhaseTimes(std::ostream &out, const PhaseTimes &times)
+{
+    out << "Phase times: load=" << times.load << " seed=" << times.seed << " assign=" << times.assign
+        << " update=" << times.update << " communicate=" << times.communicate << " total=" << times.total
+        << " iterations=" << times.iterations << "\n";
+}
+
+#endif
@@ -0,0 +1,324 @@
+// Contiguous point storage shared by the serial, OpenMP and MPI versions.
+//
+// Instead of one heap allocated vector<double> per point, all coordinates
+// live in a single aligned row-major buffer (point i occupies the range
+// [i * total_values, (i + 1) * total_values)). IDs, cluster labels and names
+// are kept in separate parallel arrays, so the assignment loop streams
+// through the coordinates linearly.
+//
+// A matrix can also be a view over coordinates it does not own (a memory
+// mapped binary dataset, see dataset_file.h): the owner handle keeps the
+// mapping alive for as long as some copy of the matrix uses it. Names are
+// interned, every point only stores the index of its name in a table of
+// distinct names.
+//
+// With --precision float (OpenMP version) the coordinates are stored in
+// single precision instead (floatData, getFloatRow): data() is then null,
+// so the points are never held in both precisions.
+
+#ifndef POINT_MATRIX_H
+#define POINT_MATRIX_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// allocator that returns memory aligned to a cache line, so rows of the
+// matrix can be read with aligned SIMD loads. resize() default-initializes
+// the elements (no zero fill), so a page is first touched, and on a NUMA
+// machine placed, by the thread that first writes it.
+template <typename T, std::size_t Alignment = 64>
+struct AlignedAllocator
+{
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind
+    {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+    T *allocate(std::size_t n)
+    {
+        return static_cast<T *>(::operator new(n * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T *p, std::size_t)
+    {
+        ::operator delete(p, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    void construct(U *p)
+    {
+        ::new (static_cast<void *>(p)) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&...args)
+    {
+        ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator==(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &)
+{
+    return true;
+}
+
+template <typename T, typename U, std::size_t Alignment>
+bool operator!=(const AlignedAllocator<T, Alignment> &, const AlignedAllocator<U, Alignment> &)
+{
+    return false;
+}
+
+typedef std::vector<double, AlignedAllocator<double>> AlignedVector;
+typedef std::vector<float, AlignedAllocator<float>> AlignedFloatVector;
+typedef std::vector<int, AlignedAllocator<int>> AlignedIntVector;
+
+class PointMatrix
+{
+private:
+    int total_points, total_values;
+    bool has_name;
+    bool single_precision;       // the coordinates are floats (float_values or external_float)
+    AlignedVector values;        // row-major coordinates, unless external is set
+    double *external;            // coordinates owned by someone else (view)
+    AlignedFloatVector float_values;
+    float *external_float;       // float coordinates owned by someone else (view)
+    std::shared_ptr<void> owner; // keeps the external buffer alive
+    AlignedIntVector ids, clusters;
+    std::vector<int> name_ids;   // per point, index into name_table
+    std::vector<std::string> name_table;
+    std::unordered_map<std::string, int> name_index;
+
+    void initialize(int total_points, int total_values, bool has_name)
+    {
+        this->total_points = total_points;
+        this->total_values = total_values;
+        this->has_name = has_name;
+
+        ids.resize(total_points);
+        clusters.resize(total_points);
+
+        if (has_name)
+            name_ids.assign(total_points, 0);
+
+        // written with the static schedule of the assignment loops, so with
+        // OpenMP the labels of a point live on the node of the thread that
+        // processes it (the coordinates are first written by the parser)
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (int i = 0; i < total_points; i++)
+        {
+            ids[i] = i;
+            clusters[i] = -1;
+        }
+    }
+
+public:
+    PointMatrix(int total_points = 0, int total_values = 0, bool has_name = false, bool single_precision = false)
+    {
+        this->single_precision = single_precision;
+        external = nullptr;
+        external_float = nullptr;
+
+        if (single_precision)
+            float_values.resize((std::size_t)total_points * total_values);
+        else
+            values.resize((std::size_t)total_points * total_values);
+        initialize(total_points, total_values, has_name);
+    }
+
+    // view over total_points * total_values row-major coordinates that are
+    // not copied; owner is released together with the last copy of the view
+    PointMatrix(double *external, std::shared_ptr<void> owner, int total_points, int total_values, bool has_name = false)
+    {
+        single_precision = false;
+        this->external = external;
+        external_float = nullptr;
+        this->owner = owner;
+        initialize(total_points, total_values, has_name);
+    }
+
+    // the same over float coordinates
+    PointMatrix(float *external_float, std::shared_ptr<void> owner, int total_points, int total_values,
+                bool has_name = false)
+    {
+        single_precision = true;
+        external = nullptr;
+        this->external_float = external_float;
+        this->owner = owner;
+        initialize(total_points, total_values, has_name);
+    }
+
+    int getTotalPoints() const
+    {
+        return total_points;
+    }
+
+    int getTotalValues() const
+    {
+        return total_values;
+    }
+
+    bool hasName() const
+    {
+        return has_name;
+    }
+
+    bool isSinglePrecision() const
+    {
+        return single_precision;
+    }
+
+    // narrows the coordinates to float and releases the double ones (or the
+    // view and its owner)
+    void convertToFloat()
+    {
+        if (single_precision)
+            return;
+
+        const double *source = data();
+        std::size_t total = (std::size_t)total_points * total_values;
+
+        float_values.resize(total);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+        for (long long v = 0; v < (long long)total; v++)
+            float_values[v] = source[v];
+
+        AlignedVector().swap(values);
+        external = nullptr;
+        owner.reset();
+        single_precision = true;
+    }
+
+    // pointer to the first float coordinate, null unless isSinglePrecision
+    float *floatData()
+    {
+        return external_float ? external_float : float_values.data();
+    }
+
+    const float *floatData() const
+    {
+        return external_float ? external_float : float_values.data();
+    }
+
+    const float *getFloatRow(int index) const
+    {
+        return floatData() + (std::size_t)index * total_values;
+    }
+
+    // pointer to the first coordinate of the whole buffer, null when the
+    // coordinates are floats
+    double *data()
+    {
+        return external ? external : values.data();
+    }
+
+    const double *data() const
+    {
+        return external ? external : values.data();
+    }
+
+    double *getRow(int index)
+    {
+        return data() + (std::size_t)index * total_values;
+    }
+
+    const double *getRow(int index) const
+    {
+        return data() + (std::size_t)index * total_values;
+    }
+
+    double getValue(int index, int value) const
+    {
+        return data()[(std::size_t)index * total_values + value];
+    }
+
+    void setValue(int index, int value, double v)
+    {
+        data()[(std::size_t)index * total_values + value] = v;
+    }
+
+    int getID(int index) const
+    {
+        return ids[index];
+    }
+
+    void setID(int index, int id_point)
+    {
+        ids[index] = id_point;
+    }
+
+    int getCluster(int index) const
+    {
+        return clusters[index];
+    }
+
+    void setCluster(int index, int id_cluster)
+    {
+        clusters[index] = id_cluster;
+    }
+
+    int *getClusters()
+    {
+        return clusters.data();
+    }
+
+    std::string getName(int index) const
+    {
+        return has_name ? name_table[name_ids[index]] : std::string();
+    }
+
+    void setName(int index, const std::string &name)
+    {
+        if (has_name)
+            name_ids[index] = internName(name);
+    }
+
+    // returns the index of name in the table of distinct names, adding it
+    // the first time it is seen
+    int internName(const std::string &name)
+    {
+        auto found = name_index.find(name);
+
+        if (found != name_index.end())
+            return found->second;
+
+        name_table.push_back(name);
+        name_index[name] = name_table.size() - 1;
+        return name_table.size() - 1;
+    }
+
+    int getNameID(int index) const
+    {
+        return name_ids[index];
+    }
+
+    void setNameID(int index, int id_name)
+    {
+        name_ids[index] = id_name;
+    }
+
+    const std::vector<std::string> &getNameTable() const
+    {
+        return name_table;
+    }
+};
+
+#endif
@@ -0,0 +1,193 @@
+// Choice of the initial centers.
+//
+// All functions draw from an explicitly seeded std::mt19937_64 owned by the
+// caller (never from rand()), so a run is reproducible with --seed and the
+// random state is not shared between threads.
+//
+//  - chooseRandomSeeds: K distinct points, uniformly (the original scheme,
+//    without the O(K^2) search over the already chosen indexes);
+//  - chooseKMeansPlusPlusSeeds: k-means++ (Arthur and Vassilvitskii), every
+//    new center is drawn with probability proportional to the squared
+//    distance to the closest center chosen so far;
+//  - weightedKMeansPlusPlus: the same over a small weighted candidate set,
+//    used by the k-means|| seeding of the MPI version to reduce its
+//    oversampled candidates to K centers.
+
+#ifndef SEEDING_H
+#define SEEDING_H
+
+#include <cstddef>
+#include <limits>
+#include <random>
+#include <unordered_set>
+#include <vector>
+
+#include "point_matrix.h"
+
+// in double whatever the coordinate types (float rows with --precision float)
+template <typename T, typename U>
+inline double squaredDistance(const T *a, const U *b, int total_values)
+{
+    double sum = 0.0;
+
+    for (int j = 0; j < total_values; j++)
+    {
+        double diff = (double)a[j] - (double)b[j];
+        sum += diff * diff;
+    }
+
+    return sum;
+}
+
+inline std::vector<int> chooseRandomSeeds(int total_points, int K, std::mt19937_64 &rng)
+{
+    std::uniform_int_distribution<int> pick(0, total_points - 1);
+    std::unordered_set<int> chosen;
+    std::vector<int> seeds;
+
+    while ((int)seeds.size() < K)
+    {
+        int index_point = pick(rng);
+
+        if (chosen.insert(index_point).second)
+            seeds.push_back(index_point);
+    }
+
+    return seeds;
+}
+
+// picks an index with probability proportional to weights[i]
+inline int sampleProportional(const std::vector<double> &weights, double total, std::mt19937_64 &rng)
+{
+    double target = std::uniform_real_distribution<double>(0.0, total)(rng);
+    int n = weights.size();
+
+    for (int i = 0; i < n; i++)
+    {
+        target -= weights[i];
+
+        if (target < 0.0)
+            return i;
+    }
+
+    // rounding can leave target slightly above zero: take the last non-zero weight
+    for (int i = n - 1; i >= 0; i--)
+    {
+        if (weights[i] > 0.0)
+            return i;
+    }
+
+    return n - 1;
+}
+
+// rows of total_values coordinates (double, or float with --precision
+// float), row i starting at values + i * stride (the strided views of
+// kmeans_lib.h)
+template <typename T>
+inline std::vector<int> chooseKMeansPlusPlusSeeds(const T *values, std::size_t stride, int total_points,
+                                                  int total_values, int K, std::mt19937_64 &rng)
+{
+    std::vector<double> min_distance(total_points, std::numeric_limits<double>::max());
+    std::vector<int> seeds;
+
+    seeds.push_back(std::uniform_int_distribution<int>(0, total_points - 1)(rng));
+
+    while ((int)seeds.size() < K)
+    {
+        const T *center = values + (std::size_t)seeds.back() * stride;
+        double total = 0.0;
+
+        // only the distances to the newest center have to be computed
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) reduction(+ : total)
+#endif
+        for (int i = 0; i < total_points; i++)
+        {
+            double d = squaredDistance(values + (std::size_t)i * stride, center, total_values);
+
+            if (d < min_distance[i])
+                min_distance[i] = d;
+            total += min_distance[i];
+        }
+
+        // every point coincides with a center: fall back to a uniform choice
+        if (total <= 0.0)
+        {
+            std::vector<int> rest = chooseRandomSeeds(total_points, K, rng);
+            std::unordered_set<int> chosen(seeds.begin(), seeds.end());
+
+            for (int i = 0; i < K && (int)seeds.size() < K; i++)
+            {
+                if (chosen.insert(rest[i]).second)
+                    seeds.push_back(rest[i]);
+            }
+            break;
+        }
+
+        seeds.push_back(sampleProportional(min_distance, total, rng));
+    }
+
+    return seeds;
+}
+
+inline std::vector<int> chooseKMeansPlusPlusSeeds(const PointMatrix &points, int K, std::mt19937_64 &rng)
+{
+    if (points.isSinglePrecision())
+        return chooseKMeansPlusPlusSeeds(points.floatData(), points.getTotalValues(), points.getTotalPoints(),
+                                         points.getTotalValues(), K, rng);
+    return chooseKMeansPlusPlusSeeds(points.data(), points.getTotalValues(), points.getTotalPoints(),
+                                     points.getTotalValues(), K, rng);
+}
+
+// candidates: total_candidates * total_values coordinates; returns the indexes
+// of the K chosen candidates
+inline std::vector<int> weightedKMeansPlusPlus(const std::vector<double> &candidates, const std::vector<double> &weights,
+                                               int total_values, int K, std::mt19937_64 &rng)
+{
+    int total_candidates = weights.size();
+    std::vector<double> min_distance(total_candidates, std::numeric_limits<double>::max());
+    std::vector<double> score(total_candidates);
+    std::vector<int> chosen;
+    double weight_sum = 0.0;
+
+    for (int c = 0; c < total_candidates; c++)
+        weight_sum += weights[c];
+
+    chosen.push_back(sampleProportional(weights, weight_sum, rng));
+
+    while ((int)chosen.size() < K)
+    {
+        const double *center = &candidates[(std::size_t)chosen.back() * total_values];
+        double total = 0.0;
+
+        for (int c = 0; c < total_candidates; c++)
+        {
+            double d = squaredDistance(&candidates[(std::size_t)c * total_values], center, total_values);
+
+            if (d < min_distance[c])
+                min_distance[c] = d;
+            score[c] = weights[c] * min_distance[c];
+            total += score[c];
+        }
+
+        if (total <= 0.0)
+        {
+            // the remaining candidates coincide with chosen ones; take any
+            // candidate not chosen yet
+            std::unordered_set<int> taken(chosen.begin(), chosen.end());
+
+            for (int c = 0; c < total_candidates && (int)chosen.size() < K; c++)
+            {
+                if (taken.insert(c).second)
+                    chosen.push_back(c);
+            }
+            break;
+        }
+
+        chosen.push_back(sampleProportional(score, total, rng));
+    }
+
+    return chosen;
+}
+
+#endif
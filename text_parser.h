@@ -0,0 +1,257 @@
+// Parallel reader for the text dataset format.
+//
+// The input is read with fread in large blocks into one buffer, the part
+// after the header is cut into one chunk per thread at blanks, and the
+// chunks are parsed at the same time with std::from_chars, straight into
+// the rows of the PointMatrix. A first parallel pass counts the tokens of
+// every chunk, so each thread knows the index of its first token, and so
+// the point and the field it starts at: line breaks carry no meaning, as
+// in the original cin reads. Names are interned per thread and merged into
+// the matrix table afterwards, in chunk order, so the table is the same as
+// the one of a sequential read.
+
+#ifndef TEXT_PARSER_H
+#define TEXT_PARSER_H
+
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "point_matrix.h"
+
+inline void textParseError(const char *message)
+{
+    std::cerr << "Invalid text dataset: " << message << "\n";
+    exit(1);
+}
+
+inline bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// reads the whole stream in 16 MB blocks
+inline std::vector<char> readAllBlocks(FILE *file)
+{
+    const std::size_t block_size = 16 << 20;
+    std::vector<char> buffer;
+    std::size_t used = 0, read;
+
+    do
+    {
+        buffer.resize(used + block_size);
+        read = fread(buffer.data() + used, 1, block_size, file);
+        used += read;
+    } while (read == block_size);
+
+    buffer.resize(used);
+    return buffer;
+}
+
+// skips blanks, line breaks included (never past end)
+inline const char *skipBlanks(const char *p, const char *end)
+{
+    while (p < end && isBlank(*p))
+        p++;
+    return p;
+}
+
+// the number at p, or nullptr when there is none; from_chars does not
+// depend on the locale, so every program reads a file the same way
+inline const char *tryParseValue(const char *p, const char *end, double &value)
+{
+#if defined(__cpp_lib_to_chars) || (defined(__GNUC__) && __GNUC__ >= 11)
+    std::from_chars_result result = std::from_chars(p, end, value);
+
+    return result.ec == std::errc() ? result.ptr : nullptr;
+#else
+    // older standard libraries have no floating point from_chars
+    char *next;
+    value = strtod(p, &next);
+
+    return next == p || next > end ? nullptr : next;
+#endif
+}
+
+inline const char *parseValue(const char *p, const char *end, double &value)
+{
+    const char *next = tryParseValue(p, end, value);
+
+    if (!next)
+        textParseError("expected a number");
+    return next;
+}
+
+// number of blank separated tokens in [begin, end)
+inline long long countTokens(const char *begin, const char *end)
+{
+    long long count = 0;
+    bool in_token = false;
+
+    for (const char *p = begin; p < end; p++)
+    {
+        bool blank = isBlank(*p);
+
+        count += !blank && !in_token;
+        in_token = !blank;
+    }
+
+    return count;
+}
+
+inline PointMatrix parseTextDataset(const std::vector<char> &buffer, int &K, int &max_iterations)
+{
+    const char *p = buffer.data(), *end = buffer.data() + buffer.size();
+    long long header[5];
+
+    // header: total_points total_values K max_iterations has_name
+    for (int h = 0; h < 5; h++)
+    {
+        p = skipBlanks(p, end);
+        std::from_chars_result result = std::from_chars(p, end, header[h]);
+
+        if (result.ec != std::errc())
+            textParseError("bad header");
+        p = result.ptr;
+    }
+
+    if (header[0] < 0 || header[1] <= 0)
+        textParseError("bad header");
+
+    int total_points = header[0], total_values = header[1];
+    bool has_name = header[4] != 0;
+    K = header[2];
+    max_iterations = header[3];
+
+    PointMatrix points(total_points, total_values, has_name);
+
+    // the values of a point (and its name) are the next tokens of the
+    // stream, wherever the line breaks fall, as with the original cin reads
+    int tokens_per_point = total_values + has_name;
+    long long total_tokens = (long long)total_points * tokens_per_point;
+
+    int total_chunks = 1;
+#ifdef _OPENMP
+    total_chunks = omp_get_max_threads();
+#endif
+
+    // chunk c covers [bounds[c], bounds[c + 1]), every bound right after a
+    // blank, so no token is split between two chunks
+    std::vector<const char *> bounds(total_chunks + 1);
+    std::size_t length = end - p;
+
+    bounds[0] = p;
+    bounds[total_chunks] = end;
+    for (int c = 1; c < total_chunks; c++)
+    {
+        const char *bound = p + length * c / total_chunks;
+
+        while (bound < end && !isBlank(bound[-1]))
+            bound++;
+        bounds[c] = bound < bounds[c - 1] ? bounds[c - 1] : bound;
+    }
+
+    std::vector<long long> first_token(total_chunks + 1, 0);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+    for (int c = 0; c < total_chunks; c++)
+        first_token[c + 1] = countTokens(bounds[c], bounds[c + 1]);
+
+    for (int c = 0; c < total_chunks; c++)
+        first_token[c + 1] += first_token[c];
+
+    if (first_token[total_chunks] < total_tokens)
+        textParseError("fewer values than announced in the header");
+
+    std::vector<std::vector<std::string>> local_tables(total_chunks);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static, 1)
+#endif
+    for (int c = 0; c < total_chunks; c++)
+    {
+        std::unordered_map<std::string_view, int> local_index;
+        std::vector<std::string> &local_table = local_tables[c];
+        const char *q = bounds[c], *chunk_end = bounds[c + 1];
+        long long last_token = first_token[c + 1] < total_tokens ? first_token[c + 1] : total_tokens;
+
+        // token t is field t % tokens_per_point of point t / tokens_per_point
+        for (long long t = first_token[c]; t < last_token; t++)
+        {
+            q = skipBlanks(q, chunk_end);
+            const char *token_end = q;
+
+            while (token_end < chunk_end && !isBlank(*token_end))
+                token_end++;
+
+            long long i = t / tokens_per_point;
+            int field = t % tokens_per_point;
+
+            if (field < total_values)
+            {
+                if (parseValue(q, token_end, points.getRow(i)[field]) != token_end)
+                    textParseError("expected a number");
+            }
+            else
+            {
+                std::string_view key(q, token_end - q);
+                auto found = local_index.find(key);
+                int id_name;
+
+                if (found != local_index.end())
+                    id_name = found->second;
+                else
+                {
+                    id_name = local_table.size();
+                    local_table.emplace_back(key);
+                    local_index.emplace(key, id_name);
+                }
+
+                points.setNameID(i, id_name);
+            }
+
+            q = token_end;
+        }
+    }
+
+    // merge the per chunk tables and translate the local name indexes; the
+    // name is the last token of a point, so every point belongs to the chunk
+    // that holds its name
+    if (has_name)
+    {
+        for (int c = 0; c < total_chunks; c++)
+        {
+            std::vector<int> global_ids(local_tables[c].size());
+
+            for (std::size_t n = 0; n < global_ids.size(); n++)
+                global_ids[n] = points.internName(local_tables[c][n]);
+
+            long long first = first_token[c] / tokens_per_point;
+            long long last = first_token[c + 1] / tokens_per_point;
+
+            for (long long i = first; i < last && i < total_points; i++)
+                points.setNameID(i, global_ids[points.getNameID(i)]);
+        }
+    }
+
+    return points;
+}
+
+inline PointMatrix readTextDataset(FILE *file, int &K, int &max_iterations)
+{
+    std::vector<char> buffer = readAllBlocks(file);
+    return parseTextDataset(buffer, K, max_iterations);
+}
+
+#endif
@@ -0,0 +1,128 @@
+// Work-stealing chunk scheduler for the OpenMP loops (--scheduler steal).
+//
+// The items of a loop (points or clusters) are cut in chunks of grain items
+// and every thread starts with a deque holding the chunks of its static
+// range, the same contiguous rows schedule(static) would give it, so the
+// pages it placed by first touch are still the ones it reads. A thread takes
+// chunks from the front of its own deque; once it is empty it steals from
+// the back of the deques of the other threads, starting with its right
+// neighbour. With pruning (Hamerly) the cost of a point varies a lot, and the
+// threads that get the cheap points take over the tail of the others instead
+// of waiting at the barrier.
+//
+// The chunks of a deque are always a contiguous range, so a deque is a
+// single 64-bit word (first chunk in the low half, end in the high half)
+// changed with compare-and-swap by the owner and by the thieves alike.
+// Nothing is ever pushed after reset, so once every deque is seen empty the
+// loop is over.
+//
+// The scheduler is created once per run and reset before every loop; the
+// worker threads are the OpenMP team, which the runtime keeps alive between
+// parallel regions.
+
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+class StealingScheduler
+{
+private:
+    // one cache line per deque, so an owner and a thief of another deque
+    // never share a line
+    struct alignas(64) ChunkDeque
+    {
+        std::atomic<uint64_t> range;
+    };
+
+    int total_threads, grain;
+    long long total_items;
+    std::unique_ptr<ChunkDeque[]> deques;
+
+    static uint64_t pack(uint32_t first, uint32_t end)
+    {
+        return (uint64_t)end << 32 | first;
+    }
+
+    // takes the first chunk of the deque (owner) or the last one (thief)
+    bool take(int victim, bool from_front, long long &chunk)
+    {
+        std::atomic<uint64_t> &range = deques[victim].range;
+        uint64_t current = range.load(std::memory_order_relaxed);
+
+        while (true)
+        {
+            uint32_t first = (uint32_t)current, end = (uint32_t)(current >> 32);
+
+            if (first >= end)
+                return false;
+
+            uint64_t next = from_front ? pack(first + 1, end) : pack(first, end - 1);
+
+            if (range.compare_exchange_weak(current, next, std::memory_order_acq_rel, std::memory_order_relaxed))
+            {
+                chunk = from_front ? first : end - 1;
+                return true;
+            }
+        }
+    }
+
+public:
+    StealingScheduler(int total_threads = 1)
+    {
+        this->total_threads = total_threads < 1 ? 1 : total_threads;
+        grain = 1;
+        total_items = 0;
+        deques.reset(new ChunkDeque[this->total_threads]);
+
+        for (int t = 0; t < this->total_threads; t++)
+            deques[t].range.store(0, std::memory_order_relaxed);
+    }
+
+    // called by a single thread, outside the loop: gives every thread the
+    // chunks of its static share of [0, total_items)
+    void reset(long long total_items, int grain)
+    {
+        this->total_items = total_items;
+        this->grain = grain < 1 ? 1 : grain;
+
+        long long total_chunks = (total_items + this->grain - 1) / this->grain;
+
+        for (int t = 0; t < total_threads; t++)
+        {
+            uint32_t first = total_chunks * t / total_threads;
+            uint32_t end = total_chunks * (t + 1) / total_threads;
+
+            deques[t].range.store(pack(first, end), std::memory_order_relaxed);
+        }
+
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    // next range [begin, end) for the thread; false when all the chunks of
+    // the loop have been taken
+    bool next(int thread, long long &begin, long long &end)
+    {
+        long long chunk;
+        bool found = thread < total_threads && take(thread, true, chunk);
+
+        for (int offset = 1; !found && offset <= total_threads; offset++)
+        {
+            int victim = (thread + offset) % total_threads;
+
+            if (victim != thread)
+                found = take(victim, false, chunk);
+        }
+
+        if (!found)
+            return false;
+
+        begin = chunk * grain;
+        end = begin + grain < total_items ? begin + grain : total_items;
+        return true;
+    }
+};
+
+#endif